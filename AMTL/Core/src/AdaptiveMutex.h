@@ -0,0 +1,213 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+#include "CpuRelax.h"
+#include "Futex.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	AdaptiveMutex spins for a while and then parks on a futex, so a thread whose lock holder
+	was preempted sleeps instead of burning its time slice.
+
+	How long to spin is tuned per mutex, much like glibc's adaptive mutexes: a thread spins up
+	to twice the running average of what acquiring took recently, plus a few rounds. A spin that
+	succeeds moves the average towards its length. Unlike glibc, a spin that runs out moves it
+	towards zero instead of towards the limit. So a mutex whose holder releases quickly keeps
+	spinning long enough to avoid the syscalls. One whose holder sits on it converges to a
+	handful of spins before parking.
+
+	unlock() only makes a syscall when somebody may be parked.
+*/
+class AdaptiveMutex
+{
+public:
+	constexpr static int MAX_SPIN = 1000;
+
+	AdaptiveMutex():
+		m_State(UNLOCKED),
+		m_SpinEstimate(0)
+	{
+	}
+
+	AdaptiveMutex(const AdaptiveMutex&) = delete;
+	AdaptiveMutex& operator=(const AdaptiveMutex&) = delete;
+
+	void lock()
+	{
+		int expected = UNLOCKED;
+		if (!m_State.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed))
+			LockSlow();
+	}
+
+	void unlock()
+	{
+		if (m_State.exchange(UNLOCKED, std::memory_order_release) == CONTENDED)
+			FutexWakeOne(m_State);
+	}
+
+	bool tryLock()
+	{
+		int expected = UNLOCKED;
+		return m_State.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+private:
+	enum
+	{
+		UNLOCKED = 0,
+		LOCKED = 1,
+		CONTENDED = 2	// locked, and somebody may be parked
+	};
+
+	void LockSlow()
+	{
+		const int estimate = m_SpinEstimate.load(std::memory_order_relaxed);
+		const int limit = (estimate * 2 + 10 < MAX_SPIN) ? estimate * 2 + 10 : MAX_SPIN;
+
+		for (int spins = 0; spins < limit; ++spins)
+		{
+			CpuRelax();
+			if (m_State.load(std::memory_order_relaxed) == UNLOCKED && tryLock())
+			{
+				Tune(estimate, spins);
+				return;
+			}
+		}
+		// spinning did not pay off: vote for parking sooner
+		Tune(estimate, 0);
+
+		// take the lock as CONTENDED: we cannot know whether other threads are still parked
+		while (m_State.exchange(CONTENDED, std::memory_order_acquire) != UNLOCKED)
+			FutexWait(m_State, CONTENDED);
+	}
+
+	// racy on purpose, it is only a hint
+	void Tune(int estimate, int spins)
+	{
+		m_SpinEstimate.store(estimate + (spins - estimate) / 8, std::memory_order_relaxed);
+	}
+
+	std::atomic<int>	m_State;
+	std::atomic<int>	m_SpinEstimate;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	AdaptiveConditionVariable is a futex based condition variable that works with any lock
+	(AdaptiveMutex, Spinlock, ...), like std::condition_variable_any, but without the internal
+	mutex and shared_ptr that one drags along. A notify with no waiters is a single load.
+
+	As with the std ones, the state the waiter checks must be changed under the same lock.
+*/
+class AdaptiveConditionVariable
+{
+public:
+	AdaptiveConditionVariable():
+		m_Sequence(0),
+		m_Waiters(0)
+	{
+	}
+
+	AdaptiveConditionVariable(const AdaptiveConditionVariable&) = delete;
+	AdaptiveConditionVariable& operator=(const AdaptiveConditionVariable&) = delete;
+
+	template<class Lock>
+	void wait(Lock& lock)
+	{
+		const int sequence = Enter();
+		lock.unlock();
+		FutexWait(m_Sequence, sequence);
+		lock.lock();
+		Leave();
+	}
+
+	template<class Lock, class Predicate>
+	void wait(Lock& lock, Predicate predicate)
+	{
+		while (!predicate())
+			wait(lock);
+	}
+
+	template<class Lock, class Rep, class Period>
+	std::cv_status wait_for(Lock& lock, const std::chrono::duration<Rep, Period>& timeout)
+	{
+		const int sequence = Enter();
+		lock.unlock();
+		const bool woken = FutexWaitFor(m_Sequence, sequence, std::chrono::duration_cast<std::chrono::nanoseconds>(timeout));
+		lock.lock();
+		Leave();
+		return woken ? std::cv_status::no_timeout : std::cv_status::timeout;
+	}
+
+	template<class Lock, class Rep, class Period, class Predicate>
+	bool wait_for(Lock& lock, const std::chrono::duration<Rep, Period>& timeout, Predicate predicate)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		while (!predicate())
+		{
+			if (wait_for(lock, deadline - std::chrono::steady_clock::now()) == std::cv_status::timeout)
+				return predicate();
+		}
+		return true;
+	}
+
+	void notify_one()
+	{
+		if (m_Waiters.load(std::memory_order_seq_cst) == 0)
+			return;
+
+		m_Sequence.fetch_add(1, std::memory_order_seq_cst);
+		FutexWakeOne(m_Sequence);
+	}
+
+	void notify_all()
+	{
+		if (m_Waiters.load(std::memory_order_seq_cst) == 0)
+			return;
+
+		m_Sequence.fetch_add(1, std::memory_order_seq_cst);
+		FutexWakeAll(m_Sequence);
+	}
+
+private:
+	// called with the lock held, so a notifier that changed the state under the lock sees us
+	int Enter()
+	{
+		m_Waiters.fetch_add(1, std::memory_order_seq_cst);
+		return m_Sequence.load(std::memory_order_seq_cst);
+	}
+
+	void Leave()
+	{
+		m_Waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	std::atomic<int>	m_Sequence;
+	std::atomic<int>	m_Waiters;
+};
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+
+namespace amtl
+{
+
+    /*
+        BoundedMPMCQueue is a fixed-capacity multi-producer,multi-consumer queue backed by a ring of cells,
+        following Dmitry Vyukov's bounded MPMC queue.
+
+        Unlike MPMCQueue it never allocates after construction: every T lives inline in its cell, and both
+        try_push() and try_pop() are a single CAS on a position counter plus a release store to the cell.
+        When the ring is full try_push() fails instead of growing, and when it is empty try_pop() fails
+        instead of blocking.
+    */
+    template<class T>
+    class BoundedMPMCQueue
+    {
+        private:
+
+            /*
+                every cell carries a sequence number that tells producers and consumers whose turn it is.
+                For the cell at index i (pos & mask == i):
+
+                    sequence == pos          the cell is free, the producer that claims pos may fill it
+                    sequence == pos + 1      the cell holds the item pushed at pos, the consumer that claims pos may take it
+                    sequence == pos + size   the consumer is done, the cell is free again for the next lap
+
+                so a thread only has to compare the sequence against the position it is about to claim to know
+                whether the queue is full/empty or whether it merely lost a race and should reload the position.
+            */
+
+            constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+            struct cell
+            {
+                std::atomic<std::size_t> sequence;
+                typename std::aligned_storage<sizeof(T),alignof(T)>::type storage;
+
+                T* value() noexcept { return reinterpret_cast<T*>(&storage); }
+            };
+
+            static_assert(std::is_nothrow_move_constructible<T>::value,"BoundedMPMCQueue requires a nothrow move constructible T");
+
+            // the position counters are hammered by opposite sides of the queue, keep them off each other's cache line
+            alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> enqueue_pos;
+            alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> dequeue_pos;
+            alignas(CACHE_LINE_SIZE) const std::size_t mask;
+            std::unique_ptr<cell[]> buffer;
+
+            static std::size_t checked_capacity(std::size_t capacity)
+            {
+                if(capacity < 2 || (capacity & (capacity - 1)) != 0)
+                {
+                    throw std::invalid_argument("BoundedMPMCQueue capacity must be a power of two and at least 2");
+                }
+                return capacity;
+            }
+
+        public:
+            // capacity must be a power of two.
+            explicit BoundedMPMCQueue(std::size_t capacity) :
+                enqueue_pos(0),
+                dequeue_pos(0),
+                mask(checked_capacity(capacity) - 1),
+                buffer(new cell[capacity])
+            {
+                for(std::size_t i = 0; i != capacity; ++i)
+                {
+                    buffer[i].sequence.store(i,std::memory_order_relaxed);
+                }
+            }
+
+            // disable copying
+            BoundedMPMCQueue& operator= (const BoundedMPMCQueue& other) = delete;
+            BoundedMPMCQueue(const BoundedMPMCQueue& other) = delete;
+
+            ~BoundedMPMCQueue()
+            {
+                // destroy whatever is still published between the two positions
+                const std::size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+                for(std::size_t pos = dequeue_pos.load(std::memory_order_relaxed); pos != tail; ++pos)
+                {
+                    cell& target = buffer[pos & mask];
+                    if(target.sequence.load(std::memory_order_relaxed) == pos + 1)
+                    {
+                        target.value()->~T();
+                    }
+                }
+            }
+
+            std::size_t capacity() const noexcept
+            {
+                return mask + 1;
+            }
+
+            // try_push constructs a T from the arguments and appends it, unless the queue is full.
+            // Returns false if the queue was full; in that case nothing is stored.
+
+            // try_push provides the strong exception safety guarantee
+            template<typename... CtorArgs>
+            bool try_push(CtorArgs&&... ctor_args)
+            {
+                // build the value before claiming a cell, a throwing constructor must not leave a claimed hole behind
+                T value{std::forward<CtorArgs>(ctor_args)...};
+
+                cell* target;
+                std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+                for(;;)
+                {
+                    target = &buffer[pos & mask];
+                    const std::size_t seq = target->sequence.load(std::memory_order_acquire);
+                    const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+
+                    if(diff == 0)
+                    {
+                        if(enqueue_pos.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed))
+                            break;
+                    }
+                    else if(diff < 0)
+                    {
+                        // the consumer of the previous lap has not freed this cell yet
+                        return false;
+                    }
+                    else
+                    {
+                        pos = enqueue_pos.load(std::memory_order_relaxed);
+                    }
+                }
+
+                new (target->value()) T(std::move(value));
+                target->sequence.store(pos + 1,std::memory_order_release);
+                return true;
+            }
+
+            // try_pop moves the front item into out and returns true, or returns false if the queue is empty.
+            // If T's move assignment throws, the item is still removed (and destroyed) and the exception propagates.
+            bool try_pop(T& out) noexcept(std::is_nothrow_move_assignable<T>::value)
+            {
+                cell* target;
+                std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+                for(;;)
+                {
+                    target = &buffer[pos & mask];
+                    const std::size_t seq = target->sequence.load(std::memory_order_acquire);
+                    const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+
+                    if(diff == 0)
+                    {
+                        if(dequeue_pos.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed))
+                            break;
+                    }
+                    else if(diff < 0)
+                    {
+                        // the producer for this position has not published yet
+                        return false;
+                    }
+                    else
+                    {
+                        pos = dequeue_pos.load(std::memory_order_relaxed);
+                    }
+                }
+
+                // the position is claimed: the cell has to be handed back to the producers even if the move throws
+                struct release_on_exit
+                {
+                    cell* target;
+                    std::size_t next;
+                    ~release_on_exit()
+                    {
+                        target->value()->~T();
+                        target->sequence.store(next,std::memory_order_release);
+                    }
+                } guard{target,pos + mask + 1};
+
+                out = std::move(*target->value());
+                return true;
+            }
+
+            // size_approx is only a snapshot, other threads may change the queue before it returns
+            std::size_t size_approx() const noexcept
+            {
+                const std::size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+                const std::size_t head = dequeue_pos.load(std::memory_order_relaxed);
+                return (tail > head) ? tail - head : 0;
+            }
+    };
+}
@@ -0,0 +1,148 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <cstdint>
+
+#include "CpuRelax.h"
+#include "LockNodePool.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	CLHLock is the Craig/Landin-Hagersten queue lock. Like MCSLock every waiter spins on its own
+	cache line, but here it spins on its predecessor's node, which makes unlock() a single store
+	with no CAS and no waiting for a late successor. The price is that nodes change hands: on
+	unlock() a thread keeps its predecessor's node and leaves its own behind for the successor.
+
+	Nodes come from a per-thread LockNodePool, so the usual lock()/unlock() interface works
+	and a thread may hold several CLHLocks at once.
+*/
+class CLHLock
+{
+public:
+	CLHLock():
+		m_Holder(nullptr),
+		m_Predecessor(nullptr)
+	{
+		Node* initial = AcquireNode(false);
+		m_Tail.store(Tag(initial), std::memory_order_relaxed);
+	}
+
+	~CLHLock()
+	{
+		Pool::Release(Untag(m_Tail.load(std::memory_order_relaxed)));
+	}
+
+	CLHLock(const CLHLock&) = delete;
+	CLHLock& operator=(const CLHLock&) = delete;
+
+	void lock()
+	{
+		Node* node = AcquireNode(true);
+
+		Node* predecessor = Untag(m_Tail.exchange(Tag(node), std::memory_order_acq_rel));
+		SpinWait wait;
+		while (predecessor->m_Locked.load(std::memory_order_acquire))
+			wait.Once();
+
+		m_Holder = node;
+		m_Predecessor = predecessor;
+	}
+
+	void unlock()
+	{
+		Node* predecessor = m_Predecessor;
+		m_Holder->m_Locked.store(false, std::memory_order_release);
+		Pool::Release(predecessor);
+	}
+
+	bool tryLock()
+	{
+		// pool nodes are never freed, so peeking at a tail that is being replaced is harmless.
+		// The generation tag makes the CAS fail if the tail node was recycled and queued again
+		// in the meantime, in which case it may be locked after all.
+		std::uintptr_t tail = m_Tail.load(std::memory_order_acquire);
+		Node* predecessor = Untag(tail);
+		if (predecessor->m_Locked.load(std::memory_order_acquire))
+			return false;
+
+		Node* node = AcquireNode(true);
+		if (!m_Tail.compare_exchange_strong(tail, Tag(node), std::memory_order_acq_rel, std::memory_order_relaxed))
+		{
+			Pool::Release(node);
+			return false;
+		}
+
+		// the tag only has TAG_MASK + 1 values: if the node was queued again a multiple of that
+		// many times between the load and the CAS, the CAS still succeeds and we are queued
+		// behind a holder. We cannot leave the queue, so wait for it as lock() would.
+		SpinWait wait;
+		while (predecessor->m_Locked.load(std::memory_order_acquire))
+			wait.Once();
+
+		m_Holder = node;
+		m_Predecessor = predecessor;
+		return true;
+	}
+
+private:
+	constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+	struct alignas(CACHE_LINE_SIZE) Node
+	{
+		std::atomic<bool>	m_Locked;
+		std::uintptr_t		m_Generation = 0;	// bumped every time the node is queued
+		Node*				m_NextFree;
+	};
+
+	// the low bits of a node address are always zero, m_Tail keeps the node's generation there.
+	// That is 6 bits, so the tag wraps after 64 reuses of a node; see tryLock()
+	constexpr static std::uintptr_t TAG_MASK = CACHE_LINE_SIZE - 1;
+
+	typedef LockNodePool<Node> Pool;
+
+	static Node* AcquireNode(bool locked)
+	{
+		Node* node = Pool::Acquire();
+		++node->m_Generation;
+		node->m_Locked.store(locked, std::memory_order_relaxed);
+		return node;
+	}
+
+	static std::uintptr_t Tag(Node* node)
+	{
+		return reinterpret_cast<std::uintptr_t>(node) | (node->m_Generation & TAG_MASK);
+	}
+
+	static Node* Untag(std::uintptr_t tail)
+	{
+		return reinterpret_cast<Node*>(tail & ~TAG_MASK);
+	}
+
+	std::atomic<std::uintptr_t>	m_Tail;
+	Node*						m_Holder;		// written and read by the holder only
+	Node*						m_Predecessor;	// ditto
+};
+//-------------------------------------------------------------------------------------------------
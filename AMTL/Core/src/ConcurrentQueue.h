@@ -0,0 +1,45 @@
+#pragma once
+
+#include "MPMCQueue.h"
+#include "MPSCQueue.h"
+#include "SPMCQueue.h"
+#include "SPSCQueue.h"
+
+namespace amtl
+{
+
+    // queue_kind names how many threads may push and pop concurrently.
+    enum class queue_kind
+    {
+        spsc,   // one producer, one consumer
+        mpsc,   // any number of producers, one consumer
+        spmc,   // one producer, any number of consumers
+        mpmc    // any number of both
+    };
+
+    namespace detail
+    {
+        template<class T, queue_kind Kind>
+        struct select_queue;
+
+        template<class T>
+        struct select_queue<T,queue_kind::spsc> { typedef SPSCQueue<T> type; };
+
+        template<class T>
+        struct select_queue<T,queue_kind::mpsc> { typedef MPSCQueue<T> type; };
+
+        template<class T>
+        struct select_queue<T,queue_kind::spmc> { typedef SPMCQueue<T> type; };
+
+        template<class T>
+        struct select_queue<T,queue_kind::mpmc> { typedef MPMCQueue<T> type; };
+    }
+
+    /*
+        ConcurrentQueue picks the cheapest queue that is safe for the given producer/consumer topology.
+        All of them share MPMCQueue's interface: push, push_bulk, pop, try_pop, pop_bulk, wait_pop and
+        wait_pop_for. Picking a narrower kind than the code actually uses is undefined behavior.
+    */
+    template<class T, queue_kind Kind = queue_kind::mpmc>
+    using ConcurrentQueue = typename detail::select_queue<T,Kind>::type;
+}
@@ -0,0 +1,449 @@
+#pragma once
+
+// coroutine support needs C++20; without it this header is empty. The library builds as C++17
+// by default, configure with -DCMAKE_CXX_STANDARD=20 to build it (and this header) as C++20
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "TaskJoin.h"
+#include "TaskProcessor.h"
+
+namespace amtl
+{
+
+    namespace detail
+    {
+
+        /*
+            coroutine_frame_pool hands out coroutine frames from per-thread free lists, one per power-of-two
+            size class. A frame is usually allocated by the thread that starts a coroutine and freed by the worker
+            that finishes it, so the lists are capped: a thread that only ever frees gives the surplus back to the
+            heap instead of hoarding it. Frames bigger than MAX_SIZE go straight to the heap.
+        */
+        class coroutine_frame_pool
+        {
+            private:
+
+                constexpr static std::size_t MIN_SHIFT = 6;      // smallest class: 64 bytes
+                constexpr static std::size_t CLASS_COUNT = 7;    // largest class: 4096 bytes
+                constexpr static std::size_t CACHE_LIMIT = 64;   // cached frames per class and thread
+
+                struct free_block
+                {
+                    free_block* next;
+                };
+
+                struct cache
+                {
+                    free_block* heads[CLASS_COUNT] = {};
+                    std::size_t counts[CLASS_COUNT] = {};
+
+                    ~cache()
+                    {
+                        for(free_block* head : heads)
+                        {
+                            while(head)
+                            {
+                                free_block* next = head->next;
+                                ::operator delete(head);
+                                head = next;
+                            }
+                        }
+                    }
+                };
+
+                static cache& local() noexcept
+                {
+                    thread_local cache frames;
+                    return frames;
+                }
+
+                static std::size_t size_class(std::size_t size) noexcept
+                {
+                    std::size_t cls = 0;
+                    while((std::size_t(1) << (MIN_SHIFT + cls)) < size)
+                        ++cls;
+                    return cls;
+                }
+
+            public:
+                constexpr static std::size_t MAX_SIZE = std::size_t(1) << (MIN_SHIFT + CLASS_COUNT - 1);
+
+                static void* allocate(std::size_t size)
+                {
+                    if(size > MAX_SIZE)
+                        return ::operator new(size);
+
+                    const std::size_t cls = size_class(size);
+                    cache& frames = local();
+                    if(free_block* block = frames.heads[cls])
+                    {
+                        frames.heads[cls] = block->next;
+                        --frames.counts[cls];
+                        return block;
+                    }
+                    return ::operator new(std::size_t(1) << (MIN_SHIFT + cls));
+                }
+
+                static void deallocate(void* frame, std::size_t size) noexcept
+                {
+                    if(size > MAX_SIZE)
+                    {
+                        ::operator delete(frame);
+                        return;
+                    }
+
+                    const std::size_t cls = size_class(size);
+                    cache& frames = local();
+                    if(frames.counts[cls] == CACHE_LIMIT)
+                    {
+                        ::operator delete(frame);
+                        return;
+                    }
+
+                    free_block* block = new (frame) free_block{frames.heads[cls]};
+                    frames.heads[cls] = block;
+                    ++frames.counts[cls];
+                }
+        };
+
+        // promise types derive from pooled_frame to get their frames from coroutine_frame_pool
+        struct pooled_frame
+        {
+            static void* operator new(std::size_t size)
+            {
+                return coroutine_frame_pool::allocate(size);
+            }
+
+            static void operator delete(void* frame, std::size_t size) noexcept
+            {
+                coroutine_frame_pool::deallocate(frame, size);
+            }
+        };
+
+        struct task_promise_base : pooled_frame
+        {
+            // resumes whoever awaits the task; a task nobody awaits just stops at its final suspend point
+            struct final_awaiter
+            {
+                bool await_ready() const noexcept { return false; }
+
+                template<class Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> done) noexcept
+                {
+                    std::coroutine_handle<> next = done.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            final_awaiter final_suspend() const noexcept { return {}; }
+
+            void unhandled_exception() noexcept
+            {
+                exception = std::current_exception();
+            }
+
+            void rethrow_if_failed()
+            {
+                if(exception)
+                    std::rethrow_exception(exception);
+            }
+
+            std::coroutine_handle<> continuation;
+            std::exception_ptr exception;
+        };
+
+        template<class T>
+        struct task_promise;
+
+    }
+
+    /*
+        task<T> is a lazy coroutine: nothing runs until it is awaited (or passed to sync_wait), and then it runs
+        on the awaiting thread up to its first suspension. When it finishes it resumes its awaiter directly by
+        symmetric transfer, so chains of tasks neither grow the stack nor go through the pool.
+
+        Frames come from detail::coroutine_frame_pool. A task owns its frame and destroys it with itself.
+        An exception escaping the coroutine is rethrown to the awaiter.
+    */
+    template<class T = void>
+    class task
+    {
+        public:
+            using promise_type = detail::task_promise<T>;
+
+            task(task&& other) noexcept :
+                handle(std::exchange(other.handle,nullptr))
+            {
+            }
+
+            task& operator= (task&& other) noexcept
+            {
+                if(this != &other)
+                {
+                    if(handle)
+                        handle.destroy();
+                    handle = std::exchange(other.handle,nullptr);
+                }
+                return *this;
+            }
+
+            task(const task&) = delete;
+            task& operator= (const task&) = delete;
+
+            ~task()
+            {
+                if(handle)
+                    handle.destroy();
+            }
+
+            bool valid() const noexcept
+            {
+                return static_cast<bool>(handle);
+            }
+
+            auto operator co_await() noexcept
+            {
+                struct awaiter : awaiter_base
+                {
+                    T await_resume()
+                    {
+                        return this->handle.promise().result();
+                    }
+                };
+                return awaiter{{handle}};
+            }
+
+            // awaits completion without taking the result or rethrowing
+            auto when_ready() noexcept
+            {
+                struct awaiter : awaiter_base
+                {
+                    void await_resume() const noexcept {}
+                };
+                return awaiter{{handle}};
+            }
+
+        private:
+            friend promise_type;
+
+            template<class U>
+            friend U sync_wait(TaskProcessor& pool,task<U> work);
+
+            struct awaiter_base
+            {
+                std::coroutine_handle<promise_type> handle;
+
+                bool await_ready() const noexcept
+                {
+                    return !handle || handle.done();
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+                {
+                    handle.promise().continuation = awaiting;
+                    return handle;
+                }
+            };
+
+            explicit task(std::coroutine_handle<promise_type> handle) noexcept :
+                handle(handle)
+            {
+            }
+
+            std::coroutine_handle<promise_type> handle;
+    };
+
+    namespace detail
+    {
+
+        template<class T>
+        struct task_promise : task_promise_base
+        {
+            static_assert(!std::is_reference<T>::value,"task<T> does not support references, return a pointer");
+
+            task<T> get_return_object() noexcept
+            {
+                return task<T>(std::coroutine_handle<task_promise>::from_promise(*this));
+            }
+
+            template<class U>
+            void return_value(U&& result)
+            {
+                value.emplace(std::forward<U>(result));
+            }
+
+            T result()
+            {
+                rethrow_if_failed();
+                return std::move(*value);
+            }
+
+            std::optional<T> value;
+        };
+
+        template<>
+        struct task_promise<void> : task_promise_base
+        {
+            task<void> get_return_object() noexcept
+            {
+                return task<void>(std::coroutine_handle<task_promise>::from_promise(*this));
+            }
+
+            void return_void() const noexcept {}
+
+            void result()
+            {
+                rethrow_if_failed();
+            }
+        };
+
+        // sync_wait_task runs a task to completion and then marks a TaskJoin done
+        class sync_wait_task
+        {
+            public:
+                struct promise_type : pooled_frame
+                {
+                    struct final_awaiter
+                    {
+                        bool await_ready() const noexcept { return false; }
+
+                        // the frame is suspended before Done, so the waiter may destroy it right away
+                        void await_suspend(std::coroutine_handle<promise_type> done) noexcept
+                        {
+                            done.promise().join->Done();
+                        }
+
+                        void await_resume() const noexcept {}
+                    };
+
+                    sync_wait_task get_return_object() noexcept
+                    {
+                        return sync_wait_task(std::coroutine_handle<promise_type>::from_promise(*this));
+                    }
+
+                    std::suspend_always initial_suspend() const noexcept { return {}; }
+                    final_awaiter final_suspend() const noexcept { return {}; }
+                    void return_void() const noexcept {}
+
+                    // when_ready() does not throw
+                    void unhandled_exception() const noexcept { std::terminate(); }
+
+                    TaskJoin* join = nullptr;
+                };
+
+                sync_wait_task(const sync_wait_task&) = delete;
+                sync_wait_task& operator= (const sync_wait_task&) = delete;
+
+                ~sync_wait_task()
+                {
+                    handle.destroy();
+                }
+
+                void start(TaskJoin& join)
+                {
+                    handle.promise().join = &join;
+                    handle.resume();
+                }
+
+            private:
+                explicit sync_wait_task(std::coroutine_handle<promise_type> handle) noexcept :
+                    handle(handle)
+                {
+                }
+
+                std::coroutine_handle<promise_type> handle;
+        };
+
+        template<class T>
+        sync_wait_task make_sync_wait_task(task<T>& work)
+        {
+            co_await work.when_ready();
+        }
+
+    }
+
+    /*
+        schedule_on suspends the awaiting coroutine and posts its resumption to the pool, so everything after
+        `co_await schedule_on(pool)` runs on one of the pool's workers. Awaiting it on a worker of the same pool
+        yields to the other queued tasks. If a pool shutdown drops the resumption, the coroutine is resumed on
+        the thread that drops it and the co_await throws TaskDropped. Like any task added after Shutdown, a
+        resumption posted then waits for a later Shutdown or the pool's destructor to drop it.
+    */
+    class schedule_awaiter
+    {
+        public:
+            schedule_awaiter(TaskProcessor& pool,TaskPriority priority) noexcept :
+                pool(pool),
+                priority(priority),
+                dropped(false)
+            {
+            }
+
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> awaiting)
+            {
+                pool.Post(priority,resumption{awaiting,this});
+            }
+
+            void await_resume() const
+            {
+                if(dropped)
+                    throw TaskDropped();
+            }
+
+        private:
+            // the awaiter lives in the suspended frame, so the resumption may point back at it
+            struct resumption
+            {
+                std::coroutine_handle<> awaiting;
+                schedule_awaiter* awaiter;
+
+                void operator()() const { awaiting.resume(); }
+
+                void OnDrop() const
+                {
+                    awaiter->dropped = true;
+                    awaiting.resume();
+                }
+            };
+
+            TaskProcessor& pool;
+            TaskPriority priority;
+            bool dropped;
+    };
+
+    inline schedule_awaiter schedule_on(TaskProcessor& pool,TaskPriority priority = TaskPriority::Normal) noexcept
+    {
+        return schedule_awaiter(pool,priority);
+    }
+
+    /*
+        sync_wait starts the task on the calling thread and blocks until it has finished, helping the pool run
+        its tasks in the meantime, so it is safe to call from a worker. Returns the task's result or rethrows
+        its exception.
+    */
+    template<class T>
+    T sync_wait(TaskProcessor& pool,task<T> work)
+    {
+        TaskJoin join(1);
+        detail::sync_wait_task waiter = detail::make_sync_wait_task(work);
+        waiter.start(join);
+        join.Wait(pool);
+        return work.handle.promise().result();
+    }
+
+}
+
+#endif
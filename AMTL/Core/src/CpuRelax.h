@@ -0,0 +1,75 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+//-------------------------------------------------------------------------------------------------
+// CpuRelax tells the core we are busy-waiting: it frees pipeline resources for the sibling
+// hyperthread and avoids the memory-order mis-speculation penalty when the awaited line changes.
+inline void CpuRelax()
+{
+#if defined(_MSC_VER) || defined(__i386__) || defined(__x86_64__)
+	_mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+//-------------------------------------------------------------------------------------------------
+/*
+	SpinWait is the wait step for locks that hand ownership to one particular waiter. It pauses
+	for the first SPIN_LIMIT pauses and then yields, because once threads outnumber cores the
+	waiter next in line may be preempted, and then no amount of spinning by the others helps.
+*/
+class SpinWait
+{
+public:
+	constexpr static unsigned SPIN_LIMIT = 128;
+
+	SpinWait() : m_Count(0) {}
+
+	void Once(unsigned pauses = 1)
+	{
+		if (m_Count < SPIN_LIMIT)
+		{
+			m_Count += pauses;
+			for (; pauses != 0; --pauses)
+				CpuRelax();
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+
+private:
+	unsigned m_Count;
+};
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,127 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+
+#include "Futex.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	EventCount lets a thread sleep until some lock-free condition becomes true, without
+	the producer side having to take a lock. The waiter does
+
+		for (;;)
+		{
+			if (condition()) break;
+			auto key = ec.PrepareWait();
+			if (condition()) { ec.CancelWait(); break; }
+			ec.Wait(key);
+		}
+
+	and the producer makes the condition true and then calls NotifyOne/NotifyAll. When nobody
+	is waiting a notify is a single load of the waiter count.
+
+	Contract: the store that makes the condition true must be a seq_cst atomic operation (or be
+	followed by a seq_cst fence), and so must the waiter's re-check after PrepareWait. Then either
+	the notifier sees the registered waiter, or the waiter sees the new state.
+*/
+class EventCount
+{
+public:
+	typedef int Key;
+
+	EventCount():
+		m_Epoch(0),
+		m_Waiters(0)
+	{
+	}
+
+	EventCount(const EventCount&) = delete;
+	EventCount& operator=(const EventCount&) = delete;
+
+	Key PrepareWait()
+	{
+		m_Waiters.fetch_add(1, std::memory_order_seq_cst);
+		return m_Epoch.load(std::memory_order_seq_cst);
+	}
+
+	void CancelWait()
+	{
+		m_Waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void Wait(Key key)
+	{
+		while (m_Epoch.load(std::memory_order_acquire) == key)
+			FutexWait(m_Epoch, key);
+
+		m_Waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// returns false if the timeout expired before a notification arrived
+	template<class Rep, class Period>
+	bool WaitFor(Key key, const std::chrono::duration<Rep, Period>& timeout)
+	{
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		bool notified = true;
+
+		while (m_Epoch.load(std::memory_order_acquire) == key)
+		{
+			auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+			if (!FutexWaitFor(m_Epoch, key, left) && m_Epoch.load(std::memory_order_acquire) == key)
+			{
+				notified = false;
+				break;
+			}
+		}
+
+		m_Waiters.fetch_sub(1, std::memory_order_relaxed);
+		return notified;
+	}
+
+	void NotifyOne()
+	{
+		if (m_Waiters.load(std::memory_order_seq_cst) == 0)
+			return;
+
+		m_Epoch.fetch_add(1, std::memory_order_seq_cst);
+		FutexWakeOne(m_Epoch);
+	}
+
+	void NotifyAll()
+	{
+		if (m_Waiters.load(std::memory_order_seq_cst) == 0)
+			return;
+
+		m_Epoch.fetch_add(1, std::memory_order_seq_cst);
+		FutexWakeAll(m_Epoch);
+	}
+
+private:
+	std::atomic<int> m_Epoch;
+	std::atomic<int> m_Waiters;
+};
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,138 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <climits>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#include <cerrno>
+#else
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#endif
+//-------------------------------------------------------------------------------------------------
+/*
+	Futex* park a thread on a 32-bit word until another thread changes it and calls FutexWake*.
+	The wait only starts if the word still holds `expected`, so a waker that changes the word
+	before waking can never be missed. Wake-ups may be spurious: always re-check the condition.
+
+	On Linux these are the private futex syscalls. Elsewhere they fall back to a small table of
+	mutex/condition_variable buckets hashed by address.
+*/
+//-------------------------------------------------------------------------------------------------
+#if defined(__linux__)
+
+inline long FutexCall(std::atomic<int>& word, int op, int value, const timespec* timeout)
+{
+	static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex word must be a plain int");
+	return syscall(SYS_futex, reinterpret_cast<int*>(&word), op, value, timeout, nullptr, 0);
+}
+//-------------------------------------------------------------------------------------------------
+inline void FutexWait(std::atomic<int>& word, int expected)
+{
+	FutexCall(word, FUTEX_WAIT_PRIVATE, expected, nullptr);
+}
+//-------------------------------------------------------------------------------------------------
+// returns false if the timeout expired
+inline bool FutexWaitFor(std::atomic<int>& word, int expected, std::chrono::nanoseconds timeout)
+{
+	if (timeout.count() <= 0)
+		return false;
+
+	timespec ts;
+	ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+	ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+
+	return !(FutexCall(word, FUTEX_WAIT_PRIVATE, expected, &ts) == -1 && errno == ETIMEDOUT);
+}
+//-------------------------------------------------------------------------------------------------
+inline void FutexWakeOne(std::atomic<int>& word)
+{
+	FutexCall(word, FUTEX_WAKE_PRIVATE, 1, nullptr);
+}
+//-------------------------------------------------------------------------------------------------
+inline void FutexWakeAll(std::atomic<int>& word)
+{
+	FutexCall(word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr);
+}
+//-------------------------------------------------------------------------------------------------
+#else
+
+struct FutexBucket
+{
+	std::mutex				m_Lock;
+	std::condition_variable	m_Wake;
+};
+//-------------------------------------------------------------------------------------------------
+inline FutexBucket& GetFutexBucket(const void* address)
+{
+	static FutexBucket buckets[64];
+	return buckets[(reinterpret_cast<std::uintptr_t>(address) >> 4) % 64];
+}
+//-------------------------------------------------------------------------------------------------
+inline void FutexWait(std::atomic<int>& word, int expected)
+{
+	FutexBucket& bucket = GetFutexBucket(&word);
+	std::unique_lock<std::mutex> lock(bucket.m_Lock);
+	if (word.load() == expected)
+		bucket.m_Wake.wait(lock);
+}
+//-------------------------------------------------------------------------------------------------
+inline bool FutexWaitFor(std::atomic<int>& word, int expected, std::chrono::nanoseconds timeout)
+{
+	if (timeout.count() <= 0)
+		return false;
+
+	FutexBucket& bucket = GetFutexBucket(&word);
+	std::unique_lock<std::mutex> lock(bucket.m_Lock);
+	if (word.load() != expected)
+		return true;
+	return bucket.m_Wake.wait_for(lock, timeout) == std::cv_status::no_timeout;
+}
+//-------------------------------------------------------------------------------------------------
+inline void FutexWakeAll(std::atomic<int>& word)
+{
+	FutexBucket& bucket = GetFutexBucket(&word);
+	{
+		std::lock_guard<std::mutex> lock(bucket.m_Lock);
+	}
+	bucket.m_Wake.notify_all();
+}
+//-------------------------------------------------------------------------------------------------
+// a bucket is shared by unrelated words, so waking just one waiter could pick the wrong one
+inline void FutexWakeOne(std::atomic<int>& word)
+{
+	FutexWakeAll(word);
+}
+//-------------------------------------------------------------------------------------------------
+#endif
+//-------------------------------------------------------------------------------------------------
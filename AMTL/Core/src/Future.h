@@ -0,0 +1,734 @@
+//
+// Futures with continuations
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <future>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "CpuRelax.h"
+#include "Futex.h"
+#include "TaskProcessor.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	Future/Promise are a lighter std::future/std::promise that can chain work: Then schedules a
+	continuation on the pool as soon as the result is there, and WhenAll/WhenAny join several
+	futures without parking a thread.
+
+	The shared state is intrusively reference counted. For Async and Then it is one allocation
+	together with the callable it runs, and the task posted to the pool is just a pointer to it,
+	so a stage costs one allocation in total. Get and Wait help the pool while the result is
+	not ready and only then sleep.
+
+	A Future is a single consumer: Get moves the result out and leaves the Future empty, and
+	Then consumes the Future it is called on.
+
+	Futures and promises keep a plain pointer to their pool: Wait helps it and Then posts to it.
+	Like a TimerHandle, they must not be used after that pool is gone. After Shutdown a wait
+	no longer helps, and a continuation attached then is not run until the pool drops it.
+*/
+template<class T> class Future;
+template<class T> class FutureWhenAll;
+template<class T> class FutureWhenAny;
+//-------------------------------------------------------------------------------------------------
+// what a Future<void> stores
+struct FutureUnit
+{
+};
+//-------------------------------------------------------------------------------------------------
+class FutureStateBase
+{
+public:
+	// runs exactly once, on whatever thread made the state ready
+	typedef void (*Callback)(void* context, std::size_t tag);
+
+	explicit FutureStateBase(TaskProcessor* pool):
+		m_Pool(pool),
+		m_Refs(1),
+		m_Status(0),
+		m_Callback(nullptr),
+		m_Context(nullptr),
+		m_Tag(0)
+	{
+	}
+
+	virtual ~FutureStateBase() {}
+
+	FutureStateBase(const FutureStateBase&) = delete;
+	FutureStateBase& operator=(const FutureStateBase&) = delete;
+
+	void AddRef()
+	{
+		m_Refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void Release()
+	{
+		if (m_Refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+
+	// the pool continuations run on and Wait helps; null runs continuations inline
+	TaskProcessor* Pool() const { return m_Pool; }
+
+	bool IsReady() const
+	{
+		return (m_Status.load(std::memory_order_acquire) & READY) != 0;
+	}
+
+	void Wait()
+	{
+		for (;;)
+		{
+			int status = m_Status.load(std::memory_order_acquire);
+			if (status & READY)
+				return;
+
+			if (m_Pool && m_Pool->RunPendingTask())
+				continue;
+
+			if (!(status & WAITING) &&
+				!m_Status.compare_exchange_weak(status, status | WAITING, std::memory_order_relaxed))
+				continue;
+
+			FutexWait(m_Status, status | WAITING);
+		}
+	}
+
+	// one callback per state at a time, a second one throws; it runs right here if the state is
+	// ready already
+	void OnReady(Callback callback, void* context, std::size_t tag = 0)
+	{
+		int status = m_Status.load(std::memory_order_acquire);
+		if (status & CONTINUED)
+			throw std::future_error(std::future_errc::future_already_retrieved);
+
+		m_Callback = callback;
+		m_Context = context;
+		m_Tag = tag;
+
+		while (!(status & READY))
+		{
+			if (m_Status.compare_exchange_weak(status, status | CONTINUED, std::memory_order_release, std::memory_order_relaxed))
+				return;
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		callback(context, tag);
+	}
+
+	/*
+		Takes the callback back. True if it will not run, so the caller undoes whatever it handed
+		to it; false if it has run or is running already. Either way the state is free for the
+		next OnReady when this returns.
+	*/
+	bool Detach()
+	{
+		int status = m_Status.load(std::memory_order_acquire);
+		SpinWait wait;
+		while (status & CONTINUED)
+		{
+			if (!(status & READY))
+			{
+				if (m_Status.compare_exchange_weak(status, status & ~CONTINUED, std::memory_order_relaxed))
+					return true;
+				continue;
+			}
+
+			// MakeReady is taking the callback out
+			wait.Once();
+			status = m_Status.load(std::memory_order_acquire);
+		}
+		return false;
+	}
+
+	void SetException(std::exception_ptr error)
+	{
+		m_Error = std::move(error);
+		MakeReady();
+	}
+
+	const std::exception_ptr& Error() const { return m_Error; }
+
+protected:
+	// publishes the result; the caller holds a reference, so the state outlives the wake-up
+	void MakeReady()
+	{
+		const int previous = m_Status.fetch_or(READY, std::memory_order_acq_rel);
+		if (previous & WAITING)
+			FutexWakeAll(m_Status);
+		if (previous & CONTINUED)
+		{
+			const Callback callback = m_Callback;
+			void* const context = m_Context;
+			const std::size_t tag = m_Tag;
+
+			// whoever the callback hands the state to may attach the next one
+			m_Status.fetch_and(~CONTINUED, std::memory_order_release);
+			callback(context, tag);
+		}
+	}
+
+	TaskProcessor*		m_Pool;
+
+private:
+	enum
+	{
+		READY		= 1,
+		CONTINUED	= 2,	// m_Callback is set
+		WAITING		= 4		// someone sleeps in Wait
+	};
+
+	std::atomic<int>	m_Refs;
+	std::atomic<int>	m_Status;
+	Callback			m_Callback;
+	void*				m_Context;
+	std::size_t			m_Tag;
+	std::exception_ptr	m_Error;
+};
+//-------------------------------------------------------------------------------------------------
+template<class T>
+class FutureState : public FutureStateBase
+{
+public:
+	typedef typename std::conditional<std::is_void<T>::value, FutureUnit, T>::type Stored;
+
+	explicit FutureState(TaskProcessor* pool):
+		FutureStateBase(pool),
+		m_HasValue(false)
+	{
+	}
+
+	~FutureState()
+	{
+		if (m_HasValue)
+			Value().~Stored();
+	}
+
+	template<class... Args>
+	void SetValue(Args&&... args)
+	{
+		new (&m_Storage) Stored(std::forward<Args>(args)...);
+		m_HasValue = true;
+		MakeReady();
+	}
+
+	Stored& Value() { return *reinterpret_cast<Stored*>(&m_Storage); }
+
+private:
+	typename std::aligned_storage<sizeof(Stored), alignof(Stored)>::type m_Storage;
+	bool m_HasValue;
+};
+//-------------------------------------------------------------------------------------------------
+template<class T>
+struct FutureInvoke
+{
+	template<class F>
+	static void Run(FutureState<T>& state, F& f) { state.SetValue(f()); }
+};
+
+template<>
+struct FutureInvoke<void>
+{
+	template<class F>
+	static void Run(FutureState<void>& state, F& f)
+	{
+		f();
+		state.SetValue();
+	}
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	FutureTask is the state of a future that some callable will produce. The callable is
+	destroyed as soon as it has run, so a chain of Then does not keep earlier stages alive.
+*/
+template<class T, class F>
+class FutureTask : public FutureState<T>
+{
+public:
+	template<class G>
+	FutureTask(TaskProcessor* pool, G&& f):
+		FutureState<T>(pool),
+		m_HasFunc(false)
+	{
+		new (&m_Func) F(std::forward<G>(f));
+		m_HasFunc = true;
+	}
+
+	~FutureTask()
+	{
+		if (m_HasFunc)
+			Func().~F();
+	}
+
+	// a Callback: runs the task on its pool, or right here without one. The caller hands over a
+	// reference for the run to release.
+	static void Schedule(void* context, std::size_t)
+	{
+		FutureTask* task = static_cast<FutureTask*>(context);
+		if (!task->m_Pool)
+		{
+			task->Run();
+			return;
+		}
+
+		try
+		{
+			task->m_Pool->Post(Runner(task));
+		}
+		catch (...)
+		{
+			// the Runner that could not be queued has broken the future already
+		}
+	}
+
+private:
+	// owns the run's reference; dropped by a pool shutdown it fails the future with TaskDropped,
+	// destroyed unrun otherwise (no slot for it) it breaks it, rather than leave it pending
+	class Runner
+	{
+	public:
+		explicit Runner(FutureTask* task) : m_Task(task) {}
+
+		Runner(Runner&& other) noexcept : m_Task(other.m_Task) { other.m_Task = nullptr; }
+
+		~Runner()
+		{
+			if (m_Task)
+				m_Task->Drop(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+		}
+
+		void operator()()
+		{
+			FutureTask* task = m_Task;
+			m_Task = nullptr;
+			task->Run();
+		}
+
+		void OnDrop()
+		{
+			FutureTask* task = m_Task;
+			m_Task = nullptr;
+			task->Drop(std::make_exception_ptr(TaskDropped()));
+		}
+
+	private:
+		FutureTask* m_Task;
+	};
+
+	void Drop(std::exception_ptr error)
+	{
+		Func().~F();
+		m_HasFunc = false;
+		this->SetException(std::move(error));
+		this->Release();
+	}
+
+	void Run()
+	{
+		try
+		{
+			FutureInvoke<T>::Run(*this, Func());
+		}
+		catch (...)
+		{
+			this->SetException(std::current_exception());
+		}
+
+		Func().~F();
+		m_HasFunc = false;
+		this->Release();
+	}
+
+	F& Func() { return *reinterpret_cast<F*>(&m_Func); }
+
+	typename std::aligned_storage<sizeof(F), alignof(F)>::type m_Func;
+	bool m_HasFunc;
+};
+//-------------------------------------------------------------------------------------------------
+template<class T, class F>
+struct FutureThenResult
+{
+	typedef typename std::result_of<F(T)>::type type;
+};
+
+template<class F>
+struct FutureThenResult<void, F>
+{
+	typedef typename std::result_of<F()>::type type;
+};
+//-------------------------------------------------------------------------------------------------
+template<class T>
+class Future
+{
+public:
+	Future() : m_State(nullptr) {}
+
+	// adopts a reference to state
+	explicit Future(FutureState<T>* state) : m_State(state) {}
+
+	Future(Future&& other) noexcept : m_State(other.m_State) { other.m_State = nullptr; }
+
+	Future& operator=(Future&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (m_State)
+				m_State->Release();
+			m_State = other.m_State;
+			other.m_State = nullptr;
+		}
+		return *this;
+	}
+
+	Future(const Future&) = delete;
+	Future& operator=(const Future&) = delete;
+
+	~Future()
+	{
+		if (m_State)
+			m_State->Release();
+	}
+
+	bool Valid() const { return m_State != nullptr; }
+	bool IsReady() const { return m_State->IsReady(); }
+	void Wait() const { m_State->Wait(); }
+
+	// waits, then returns the result or rethrows the exception; leaves the Future empty
+	T Get()
+	{
+		Future hold(std::move(*this));
+		hold.m_State->Wait();
+
+		if (hold.m_State->Error())
+			std::rethrow_exception(hold.m_State->Error());
+		return static_cast<T>(std::move(hold.m_State->Value()));
+	}
+
+	/*
+		Then runs f(result) (f() for Future<void>) once this future is ready and returns a future
+		for what f returns. If this future holds an exception f is skipped and the exception is
+		passed on. f runs on the given pool, by default the one this future's value comes from.
+	*/
+	template<class F>
+	Future<typename FutureThenResult<T, typename std::decay<F>::type>::type> Then(F&& f)
+	{
+		return Then(m_State->Pool(), std::forward<F>(f));
+	}
+
+	template<class F>
+	Future<typename FutureThenResult<T, typename std::decay<F>::type>::type> Then(TaskProcessor& pool, F&& f)
+	{
+		return Then(&pool, std::forward<F>(f));
+	}
+
+private:
+	template<class F>
+	class Continuation
+	{
+	public:
+		template<class G>
+		Continuation(Future&& source, G&& f):
+			m_Source(std::move(source)),
+			m_Func(std::forward<G>(f))
+		{
+		}
+
+		typename FutureThenResult<T, F>::type operator()()
+		{
+			return Call(std::is_void<T>());
+		}
+
+	private:
+		typename FutureThenResult<T, F>::type Call(std::false_type) { return m_Func(m_Source.Get()); }
+
+		typename FutureThenResult<T, F>::type Call(std::true_type)
+		{
+			m_Source.Get();
+			return m_Func();
+		}
+
+		Future	m_Source;
+		F		m_Func;
+	};
+
+	template<class F>
+	Future<typename FutureThenResult<T, typename std::decay<F>::type>::type> Then(TaskProcessor* pool, F&& f)
+	{
+		typedef typename std::decay<F>::type Func;
+		typedef typename FutureThenResult<T, Func>::type Result;
+		typedef FutureTask<Result, Continuation<Func>> Task;
+
+		FutureState<T>* source = m_State;
+		Task* task = new Task(pool, Continuation<Func>(std::move(*this), std::forward<F>(f)));
+
+		// one reference for the returned future, one for the run
+		Future<Result> result(task);
+		task->AddRef();
+		try
+		{
+			source->OnReady(&Task::Schedule, task);
+		}
+		catch (...)
+		{
+			task->Release();
+			throw;
+		}
+		return result;
+	}
+
+	template<class U> friend class FutureWhenAll;
+	template<class U> friend class FutureWhenAny;
+
+	FutureState<T>* m_State;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	Promise is the producer side for results that do not come from a task. Continuations of its
+	future run on the given pool, or inline in SetValue/SetException without one. A promise
+	destroyed without a result breaks its future with std::future_errc::broken_promise.
+*/
+template<class T>
+class Promise
+{
+public:
+	Promise() : Promise(nullptr) {}
+	explicit Promise(TaskProcessor& pool) : Promise(&pool) {}
+
+	Promise(Promise&& other) noexcept:
+		m_State(other.m_State),
+		m_Retrieved(other.m_Retrieved),
+		m_Satisfied(other.m_Satisfied)
+	{
+		other.m_State = nullptr;
+	}
+
+	Promise(const Promise&) = delete;
+	Promise& operator=(const Promise&) = delete;
+
+	~Promise()
+	{
+		if (!m_State)
+			return;
+		if (!m_Satisfied)
+			m_State->SetException(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+		m_State->Release();
+	}
+
+	Future<T> GetFuture()
+	{
+		if (m_Retrieved)
+			throw std::future_error(std::future_errc::future_already_retrieved);
+		m_Retrieved = true;
+
+		m_State->AddRef();
+		return Future<T>(m_State);
+	}
+
+	template<class... Args>
+	void SetValue(Args&&... args)
+	{
+		Satisfy();
+		m_State->SetValue(std::forward<Args>(args)...);
+	}
+
+	void SetException(std::exception_ptr error)
+	{
+		Satisfy();
+		m_State->SetException(std::move(error));
+	}
+
+private:
+	explicit Promise(TaskProcessor* pool):
+		m_State(new FutureState<T>(pool)),
+		m_Retrieved(false),
+		m_Satisfied(false)
+	{
+	}
+
+	void Satisfy()
+	{
+		if (m_Satisfied)
+			throw std::future_error(std::future_errc::promise_already_satisfied);
+		m_Satisfied = true;
+	}
+
+	FutureState<T>*	m_State;
+	bool			m_Retrieved;
+	bool			m_Satisfied;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	Async runs t(args...) on the pool and returns a Future for its result.
+*/
+template<class T, class... Args>
+auto Async(TaskProcessor& pool, T&& t, Args&&... args)
+	-> Future<typename std::result_of<T(Args...)>::type>
+{
+	typedef typename std::result_of<T(Args...)>::type Result;
+	typedef decltype(BindTask(std::forward<T>(t), std::forward<Args>(args)...)) Func;
+	typedef FutureTask<Result, Func> Task;
+
+	Task* task = new Task(&pool, BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	task->AddRef();
+	Task::Schedule(task, 0);
+	return Future<Result>(task);
+}
+//-------------------------------------------------------------------------------------------------
+template<class T>
+class FutureWhenAll : public FutureState<std::vector<Future<T>>>
+{
+public:
+	explicit FutureWhenAll(std::vector<Future<T>>&& inputs):
+		FutureState<std::vector<Future<T>>>(inputs.empty() ? nullptr : inputs.front().m_State->Pool()),
+		m_Inputs(std::move(inputs)),
+		m_Remaining(m_Inputs.size() + 1)
+	{
+	}
+
+	void Start()
+	{
+		// the extra count keeps the inputs in place until every callback is attached
+		for (Future<T>& input : m_Inputs)
+		{
+			this->AddRef();
+			input.m_State->OnReady(&InputReady, this);
+		}
+		Arrive();
+	}
+
+private:
+	static void InputReady(void* context, std::size_t)
+	{
+		FutureWhenAll* self = static_cast<FutureWhenAll*>(context);
+		self->Arrive();
+		self->Release();
+	}
+
+	void Arrive()
+	{
+		if (m_Remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			this->SetValue(std::move(m_Inputs));
+	}
+
+	std::vector<Future<T>>		m_Inputs;
+	std::atomic<std::size_t>	m_Remaining;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	WhenAll returns a future that becomes ready, holding the same futures, once all of them are.
+	Exceptions stay inside the individual futures.
+*/
+template<class T>
+Future<std::vector<Future<T>>> WhenAll(std::vector<Future<T>> futures)
+{
+	FutureWhenAll<T>* all = new FutureWhenAll<T>(std::move(futures));
+	Future<std::vector<Future<T>>> result(all);
+	all->Start();
+	return result;
+}
+//-------------------------------------------------------------------------------------------------
+template<class T>
+struct WhenAnyResult
+{
+	std::size_t				m_Index;	// the first future that became ready
+	std::vector<Future<T>>	m_Futures;
+};
+//-------------------------------------------------------------------------------------------------
+template<class T>
+class FutureWhenAny : public FutureState<WhenAnyResult<T>>
+{
+public:
+	constexpr static std::size_t NONE = static_cast<std::size_t>(-1);
+
+	explicit FutureWhenAny(std::vector<Future<T>>&& inputs):
+		FutureState<WhenAnyResult<T>>(inputs.empty() ? nullptr : inputs.front().m_State->Pool()),
+		m_Inputs(std::move(inputs)),
+		m_Index(NONE),
+		m_Remaining(m_Inputs.empty() ? 1 : 2)
+	{
+	}
+
+	void Start()
+	{
+		// ready once the first input is and every callback is attached
+		for (std::size_t i = 0; i < m_Inputs.size(); ++i)
+		{
+			this->AddRef();
+			m_Inputs[i].m_State->OnReady(&InputReady, this, i);
+		}
+		Arrive();
+	}
+
+private:
+	static void InputReady(void* context, std::size_t index)
+	{
+		FutureWhenAny* self = static_cast<FutureWhenAny*>(context);
+
+		std::size_t expected = NONE;
+		if (self->m_Index.compare_exchange_strong(expected, index, std::memory_order_relaxed))
+			self->Arrive();
+		self->Release();
+	}
+
+	void Arrive()
+	{
+		if (m_Remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+
+		// the losers are handed back, so they must not keep our callback: Then on one of them
+		// would clash with it, and we would never get its reference back
+		for (Future<T>& input : m_Inputs)
+		{
+			if (input.m_State->Detach())
+				this->Release();
+		}
+		this->SetValue(WhenAnyResult<T>{ m_Index.load(std::memory_order_relaxed), std::move(m_Inputs) });
+	}
+
+	std::vector<Future<T>>		m_Inputs;
+	std::atomic<std::size_t>	m_Index;
+	std::atomic<int>			m_Remaining;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	WhenAny returns a future that becomes ready, holding the same futures and the index of the
+	first one that was ready, as soon as any of them is. For no futures at all it is ready at
+	once with m_Index == FutureWhenAny<T>::NONE.
+*/
+template<class T>
+Future<WhenAnyResult<T>> WhenAny(std::vector<Future<T>> futures)
+{
+	FutureWhenAny<T>* any = new FutureWhenAny<T>(std::move(futures));
+	Future<WhenAnyResult<T>> result(any);
+	any->Start();
+	return result;
+}
+//-------------------------------------------------------------------------------------------------
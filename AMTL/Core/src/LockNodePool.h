@@ -0,0 +1,123 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+#include "SpinLock.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	LockNodePool recycles the per-waiter nodes of the queue locks (MCSLock, CLHLock).
+	Every thread keeps a private free list, so lock() and unlock() normally touch no shared
+	memory besides the lock itself. When a thread exits its nodes go to a shared list for
+	other threads to pick up. Nodes are never freed, so a stale pointer to a node always
+	points at a live Node, which the queue locks rely on.
+
+	Node must have a `Node* m_NextFree` member.
+*/
+template<class Node>
+class LockNodePool
+{
+public:
+	static Node* Acquire()
+	{
+		Cache& cache = GetCache();
+		if (Node* node = cache.m_Head)
+		{
+			cache.m_Head = node->m_NextFree;
+			return node;
+		}
+
+		Shared& shared = GetShared();
+		{
+			std::lock_guard<Spinlock> lock(shared.m_Lock);
+			if (Node* node = shared.m_Head)
+			{
+				shared.m_Head = node->m_NextFree;
+				return node;
+			}
+		}
+		return Allocate();
+	}
+
+	static void Release(Node* node)
+	{
+		Cache& cache = GetCache();
+		node->m_NextFree = cache.m_Head;
+		cache.m_Head = node;
+	}
+
+private:
+	struct Shared
+	{
+		Spinlock	m_Lock;
+		Node*		m_Head = nullptr;
+	};
+
+	struct Cache
+	{
+		~Cache()
+		{
+			if (!m_Head)
+				return;
+
+			Node* last = m_Head;
+			while (last->m_NextFree)
+				last = last->m_NextFree;
+
+			Shared& shared = GetShared();
+			std::lock_guard<Spinlock> lock(shared.m_Lock);
+			last->m_NextFree = shared.m_Head;
+			shared.m_Head = m_Head;
+		}
+
+		Node* m_Head = nullptr;
+	};
+
+	// nodes are never freed, so over-allocating to get cache line alignment (which plain new only
+	// guarantees since C++17) costs nothing later
+	static Node* Allocate()
+	{
+		const std::uintptr_t raw = reinterpret_cast<std::uintptr_t>(::operator new(sizeof(Node) + alignof(Node)));
+		const std::uintptr_t aligned = (raw + alignof(Node) - 1) & ~static_cast<std::uintptr_t>(alignof(Node) - 1);
+		return new (reinterpret_cast<void*>(aligned)) Node;
+	}
+
+	// intentionally never destroyed: thread caches may be flushed into it during static destruction
+	static Shared& GetShared()
+	{
+		static Shared* shared = new Shared;
+		return *shared;
+	}
+
+	static Cache& GetCache()
+	{
+		static thread_local Cache cache;
+		return cache;
+	}
+};
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,301 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(AMTL_LOCK_STATS)
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#endif
+//-------------------------------------------------------------------------------------------------
+/*
+	Lock contention statistics, compiled in only when AMTL_LOCK_STATS is defined.
+
+	A lock that supports them derives from LockStats and reports every acquisition (how long it
+	waited, in cycles, and how many times it spun) and every release (how long it was held).
+	All live LockStats are linked into LockStatsRegistry, which can snapshot or dump them at
+	any time, e.g. from a signal handler thread or an admin command:
+
+		LockStatsRegistry::Dump(std::cerr);
+
+	Without AMTL_LOCK_STATS, LockStats is an empty base class whose hooks are empty inline
+	functions, so the locks keep their size and their code.
+*/
+struct LockStatsSnapshot
+{
+	std::string		m_Name;
+	std::uint64_t	m_Acquisitions;
+	std::uint64_t	m_Contended;		// acquisitions that did not succeed on the first try
+	std::uint64_t	m_SpinIterations;
+	std::uint64_t	m_TotalWaitCycles;
+	std::uint64_t	m_MaxWaitCycles;
+	std::uint64_t	m_TotalHoldCycles;
+	std::uint64_t	m_MaxHoldCycles;
+};
+//-------------------------------------------------------------------------------------------------
+#if defined(AMTL_LOCK_STATS)
+
+inline std::uint64_t ReadCycleCounter()
+{
+#if defined(_MSC_VER) || defined(__i386__) || defined(__x86_64__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	std::uint64_t ticks;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	return static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+//-------------------------------------------------------------------------------------------------
+class LockStats
+{
+public:
+	void SetName(const char* name) { m_Name.store(name, std::memory_order_relaxed); }
+
+protected:
+	LockStats();
+	~LockStats();
+
+	LockStats(const LockStats&) = delete;
+	LockStats& operator=(const LockStats&) = delete;
+
+	static std::uint64_t StatsClock() { return ReadCycleCounter(); }
+
+	// the hooks run while the lock is held, so the counters need no read-modify-write
+	void StatsAcquired(std::uint64_t waitStart, std::uint64_t spins)
+	{
+		const std::uint64_t now = ReadCycleCounter();
+		const std::uint64_t wait = now - waitStart;
+
+		Bump(m_Acquisitions, 1);
+		if (spins != 0)
+		{
+			Bump(m_Contended, 1);
+			Bump(m_SpinIterations, spins);
+		}
+		Bump(m_TotalWaitCycles, wait);
+		Raise(m_MaxWaitCycles, wait);
+		m_AcquiredAt = now;
+	}
+
+	void StatsReleased()
+	{
+		const std::uint64_t hold = ReadCycleCounter() - m_AcquiredAt;
+		Bump(m_TotalHoldCycles, hold);
+		Raise(m_MaxHoldCycles, hold);
+	}
+
+private:
+	friend class LockStatsRegistry;
+
+	typedef std::atomic<std::uint64_t> Counter;
+
+	static void Bump(Counter& counter, std::uint64_t value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	static void Raise(Counter& counter, std::uint64_t value)
+	{
+		if (value > counter.load(std::memory_order_relaxed))
+			counter.store(value, std::memory_order_relaxed);
+	}
+
+	constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+	// the counters are written on every acquisition, keep them off the line waiters spin on
+	alignas(CACHE_LINE_SIZE) Counter	m_Acquisitions;
+	Counter						m_Contended;
+	Counter						m_SpinIterations;
+	Counter						m_TotalWaitCycles;
+	Counter						m_MaxWaitCycles;
+	Counter						m_TotalHoldCycles;
+	Counter						m_MaxHoldCycles;
+	std::uint64_t				m_AcquiredAt;		// holder only
+
+	std::atomic<const char*>	m_Name;
+	LockStats*					m_Prev;				// registry links, guarded by the registry lock
+	LockStats*					m_Next;
+};
+//-------------------------------------------------------------------------------------------------
+class LockStatsRegistry
+{
+public:
+	static std::vector<LockStatsSnapshot> Snapshot()
+	{
+		std::vector<LockStatsSnapshot> result;
+		Registry& registry = GetRegistry();
+		std::lock_guard<std::mutex> lock(registry.m_Lock);
+
+		for (LockStats* stats = registry.m_Head; stats; stats = stats->m_Next)
+		{
+			LockStatsSnapshot snapshot;
+			const char* name = stats->m_Name.load(std::memory_order_relaxed);
+			snapshot.m_Name = name ? name : "<unnamed>";
+			snapshot.m_Acquisitions = stats->m_Acquisitions.load(std::memory_order_relaxed);
+			snapshot.m_Contended = stats->m_Contended.load(std::memory_order_relaxed);
+			snapshot.m_SpinIterations = stats->m_SpinIterations.load(std::memory_order_relaxed);
+			snapshot.m_TotalWaitCycles = stats->m_TotalWaitCycles.load(std::memory_order_relaxed);
+			snapshot.m_MaxWaitCycles = stats->m_MaxWaitCycles.load(std::memory_order_relaxed);
+			snapshot.m_TotalHoldCycles = stats->m_TotalHoldCycles.load(std::memory_order_relaxed);
+			snapshot.m_MaxHoldCycles = stats->m_MaxHoldCycles.load(std::memory_order_relaxed);
+			result.push_back(snapshot);
+		}
+		return result;
+	}
+
+	// one line per lock, the locks that waited the longest first; unused locks are skipped
+	static void Dump(std::ostream& out)
+	{
+		std::vector<LockStatsSnapshot> snapshot = Snapshot();
+		std::sort(snapshot.begin(), snapshot.end(), [](const LockStatsSnapshot& a, const LockStatsSnapshot& b)
+		{
+			return a.m_TotalWaitCycles > b.m_TotalWaitCycles;
+		});
+
+		out << std::left << std::setw(40) << "lock" << std::right
+			<< std::setw(14) << "acquired" << std::setw(14) << "contended" << std::setw(16) << "spins"
+			<< std::setw(18) << "wait cycles" << std::setw(16) << "max wait"
+			<< std::setw(18) << "hold cycles" << std::setw(16) << "max hold" << '\n';
+
+		for (const LockStatsSnapshot& s : snapshot)
+		{
+			if (s.m_Acquisitions == 0)
+				continue;
+
+			out << std::left << std::setw(40) << s.m_Name << std::right
+				<< std::setw(14) << s.m_Acquisitions << std::setw(14) << s.m_Contended << std::setw(16) << s.m_SpinIterations
+				<< std::setw(18) << s.m_TotalWaitCycles << std::setw(16) << s.m_MaxWaitCycles
+				<< std::setw(18) << s.m_TotalHoldCycles << std::setw(16) << s.m_MaxHoldCycles << '\n';
+		}
+	}
+
+private:
+	friend class LockStats;
+
+	struct Registry
+	{
+		std::mutex	m_Lock;
+		LockStats*	m_Head = nullptr;
+	};
+
+	// intentionally never destroyed: static locks unregister during static destruction
+	static Registry& GetRegistry()
+	{
+		static Registry* registry = new Registry;
+		return *registry;
+	}
+};
+//-------------------------------------------------------------------------------------------------
+inline LockStats::LockStats():
+	m_Acquisitions(0),
+	m_Contended(0),
+	m_SpinIterations(0),
+	m_TotalWaitCycles(0),
+	m_MaxWaitCycles(0),
+	m_TotalHoldCycles(0),
+	m_MaxHoldCycles(0),
+	m_AcquiredAt(0),
+	m_Name(nullptr),
+	m_Prev(nullptr)
+{
+	LockStatsRegistry::Registry& registry = LockStatsRegistry::GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.m_Lock);
+	m_Next = registry.m_Head;
+	if (m_Next)
+		m_Next->m_Prev = this;
+	registry.m_Head = this;
+}
+//-------------------------------------------------------------------------------------------------
+inline LockStats::~LockStats()
+{
+	LockStatsRegistry::Registry& registry = LockStatsRegistry::GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.m_Lock);
+	if (m_Prev)
+		m_Prev->m_Next = m_Next;
+	else
+		registry.m_Head = m_Next;
+	if (m_Next)
+		m_Next->m_Prev = m_Prev;
+}
+//-------------------------------------------------------------------------------------------------
+#else
+
+class LockStats
+{
+public:
+	void SetName(const char*) {}
+
+protected:
+	static std::uint64_t StatsClock() { return 0; }
+	void StatsAcquired(std::uint64_t, std::uint64_t) {}
+	void StatsReleased() {}
+};
+//-------------------------------------------------------------------------------------------------
+class LockStatsRegistry
+{
+public:
+	static std::vector<LockStatsSnapshot> Snapshot() { return std::vector<LockStatsSnapshot>(); }
+
+	static void Dump(std::ostream& out)
+	{
+		out << "lock statistics are disabled, build with AMTL_LOCK_STATS\n";
+	}
+};
+
+#endif
+//-------------------------------------------------------------------------------------------------
+// SetLockName names a lock in the statistics if it keeps any, and does nothing otherwise
+template<class Lock>
+auto SetLockName(Lock& lock, const char* name, int) -> decltype(lock.SetName(name), void())
+{
+	lock.SetName(name);
+}
+
+template<class Lock>
+void SetLockName(Lock&, const char*, long)
+{
+}
+
+template<class Lock>
+void SetLockName(Lock& lock, const char* name)
+{
+	SetLockName(lock, name, 0);
+}
+//-------------------------------------------------------------------------------------------------
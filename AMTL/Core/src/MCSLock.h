@@ -0,0 +1,122 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+
+#include "CpuRelax.h"
+#include "LockNodePool.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	MCSLock is the Mellor-Crummey/Scott queue lock. Waiters form a linked list, and each one
+	spins on a flag in its own node, on its own cache line; unlock() hands the lock to the next
+	node by clearing just that flag. A contended hand-off therefore costs one cache miss no
+	matter how many threads wait, and the lock is FIFO fair.
+
+	Nodes come from a per-thread LockNodePool, so the usual lock()/unlock() interface works
+	and a thread may hold several MCSLocks at once.
+*/
+class MCSLock
+{
+public:
+	MCSLock() : m_Tail(nullptr), m_Holder(nullptr) {}
+
+	MCSLock(const MCSLock&) = delete;
+	MCSLock& operator=(const MCSLock&) = delete;
+
+	void lock()
+	{
+		Node* node = Pool::Acquire();
+		node->m_Next.store(nullptr, std::memory_order_relaxed);
+		node->m_Waiting.store(true, std::memory_order_relaxed);
+
+		Node* predecessor = m_Tail.exchange(node, std::memory_order_acq_rel);
+		if (predecessor)
+		{
+			predecessor->m_Next.store(node, std::memory_order_release);
+			SpinWait wait;
+			while (node->m_Waiting.load(std::memory_order_acquire))
+				wait.Once();
+		}
+		m_Holder = node;
+	}
+
+	void unlock()
+	{
+		Node* node = m_Holder;
+		Node* successor = node->m_Next.load(std::memory_order_acquire);
+		if (!successor)
+		{
+			Node* expected = node;
+			if (m_Tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel, std::memory_order_relaxed))
+			{
+				Pool::Release(node);
+				return;
+			}
+
+			// a new waiter swapped itself in but has not linked to us yet
+			SpinWait wait;
+			while (!(successor = node->m_Next.load(std::memory_order_acquire)))
+				wait.Once();
+		}
+
+		successor->m_Waiting.store(false, std::memory_order_release);
+		Pool::Release(node);
+	}
+
+	bool tryLock()
+	{
+		if (m_Tail.load(std::memory_order_relaxed))
+			return false;
+
+		Node* node = Pool::Acquire();
+		node->m_Next.store(nullptr, std::memory_order_relaxed);
+
+		Node* expected = nullptr;
+		if (!m_Tail.compare_exchange_strong(expected, node, std::memory_order_acquire, std::memory_order_relaxed))
+		{
+			Pool::Release(node);
+			return false;
+		}
+		m_Holder = node;
+		return true;
+	}
+
+private:
+	constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+	struct alignas(CACHE_LINE_SIZE) Node
+	{
+		std::atomic<Node*>	m_Next;
+		std::atomic<bool>	m_Waiting;
+		Node*				m_NextFree;
+	};
+
+	typedef LockNodePool<Node> Pool;
+
+	std::atomic<Node*>	m_Tail;
+	Node*				m_Holder;	// written and read by the holder only
+};
+//-------------------------------------------------------------------------------------------------
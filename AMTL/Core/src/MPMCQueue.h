@@ -1,20 +1,186 @@
+#pragma once
+
 #include <atomic>
 #include <memory>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <type_traits>
+
+#include "BoundedMPMCQueue.h"
+#include "WaitableQueue.h"
 
 namespace amtl
 {
-    
+
+    // where MPMCQueue keeps its elements: in a separate heap allocation per element (the default),
+    // or constructed directly inside the queue node.
+    enum class value_storage
+    {
+        heap,
+        in_node
+    };
+
+    namespace detail
+    {
+        // mpmc_value hides the difference between the two storage modes from the queue algorithm.
+        // A pusher claims a node by CAS-ing claim() into its data field, then calls commit() to make the
+        // value visible; a popper that detached the node calls published() to get at the value.
+
+        template<class T, value_storage Storage>
+        struct mpmc_value;
+
+        template<class T>
+        struct mpmc_value<T,value_storage::heap>
+        {
+            struct slot
+            {
+            };
+
+            class holder
+            {
+                public:
+                    template<typename... CtorArgs>
+                    explicit holder(CtorArgs&&... ctor_args) : value{ new T{std::forward<CtorArgs>(ctor_args)...} } {}
+
+                    // the value is complete before the claim, so the claim itself publishes it
+                    T* claim() const noexcept { return value.get(); }
+                    void commit(std::atomic<T*>&, slot&) noexcept { value.release(); }
+
+                    // take over a value already committed to a node nobody else can see
+                    void adopt(T* published) noexcept { value.reset(published); }
+
+                private:
+                    std::unique_ptr<T> value;
+            };
+
+            static T* published(const std::atomic<T*>& data) noexcept
+            {
+                return data.load();
+            }
+
+            static std::unique_ptr<T> take(T* value) noexcept
+            {
+                return std::unique_ptr<T>{value};
+            }
+
+            static void take(T* value, T& out)
+            {
+                std::unique_ptr<T> owned{value};
+                out = std::move(*owned);
+            }
+
+            static void destroy(T* value) noexcept
+            {
+                delete value;
+            }
+        };
+
+        template<class T>
+        struct mpmc_value<T,value_storage::in_node>
+        {
+            static_assert(std::is_nothrow_move_constructible<T>::value,"value_storage::in_node requires a nothrow move constructible T");
+
+            struct slot
+            {
+                typename std::aligned_storage<sizeof(T),alignof(T)>::type storage;
+            };
+
+            class holder
+            {
+                public:
+                    // the value is built up front, a throwing constructor must not leave a claimed node behind
+                    template<typename... CtorArgs>
+                    explicit holder(CtorArgs&&... ctor_args) : value{std::forward<CtorArgs>(ctor_args)...} {}
+
+                    // the node's storage is only known after the claim, so claim with a marker and
+                    // publish the real address once the value has been moved in
+                    T* claim() const noexcept { return claimed_marker(); }
+
+                    void commit(std::atomic<T*>& data, slot& target) noexcept
+                    {
+                        T* const address = reinterpret_cast<T*>(&target.storage);
+                        new (address) T(std::move(value));
+                        data.store(address,std::memory_order_release);
+                    }
+
+                    // take over a value already committed to a node nobody else can see
+                    void adopt(T* published) noexcept
+                    {
+                        value.~T();
+                        new (&value) T(std::move(*published));
+                        published->~T();
+                    }
+
+                private:
+                    T value;
+            };
+
+            // a helping pusher can swing tail past a claimed node before its owner committed the value,
+            // so a popper may get there first and has to wait out the few instructions of the move
+            static T* published(const std::atomic<T*>& data) noexcept
+            {
+                T* value;
+                while((value = data.load(std::memory_order_acquire)) == claimed_marker())
+                {
+                    std::this_thread::yield();
+                }
+                return value;
+            }
+
+            static T* claimed_marker() noexcept
+            {
+                static char marker;
+                return reinterpret_cast<T*>(&marker);
+            }
+
+            // pop() keeps its unique_ptr interface in this mode too, at the cost of one allocation on the consumer side
+            static std::unique_ptr<T> take(T* value)
+            {
+                struct destroy_on_exit
+                {
+                    T* value;
+                    ~destroy_on_exit() { value->~T(); }
+                } guard{value};
+
+                return std::unique_ptr<T>{ new T(std::move(*value)) };
+            }
+
+            static void take(T* value, T& out)
+            {
+                out = std::move(*value);
+                value->~T();
+            }
+
+            static void destroy(T* value) noexcept
+            {
+                value->~T();
+            }
+        };
+    }
+
     /*
         MPMCQueue is a lock-free multi-producer,multi-consumer queue.
-        
 
+        Retired nodes are not handed back to the global allocator right away. Each queue keeps up to
+        max_cached_nodes of them in a lock-free free list (a BoundedMPMCQueue of node pointers) and push()
+        takes its node from there first, so a queue that stays within that many elements of its high-water
+        mark does not touch malloc/free for nodes at all.
 
+        With value_storage::in_node the element is move-constructed into aligned storage inside its node
+        instead of getting an allocation of its own. Together with node recycling this makes push()/try_pop()
+        allocation-free, and the consumer reads the value from the node it already has in cache. Use try_pop()
+        in this mode; pop() still works, but has to allocate the unique_ptr it returns.
     */
-    template<class T>
-    class MPMCQueue
+    template<class T, value_storage Storage = value_storage::heap>
+    class MPMCQueue : public detail::waitable_queue<MPMCQueue<T,Storage>,T>
     {
         private:
 
+            typedef detail::mpmc_value<T,Storage> value_ops;
+
             /* 
                 the internals of this queue follow the technique used in Joe Seigh's Atomic Ptr Plus project.
                 It continues to use reference counting as the primary method of memory reclamation, but extracts
@@ -52,7 +218,7 @@ namespace amtl
 
             struct node_counter
             {
-                unsigned internal_count : sizeof(int)-2;
+                unsigned internal_count : sizeof(int)*CHAR_BIT-2;
                 unsigned external_counters : 2;
             };
 
@@ -62,11 +228,19 @@ namespace amtl
             {
                 std::atomic<T*> data;                   // pushing onto the queue is done by atomically CAS-ing this data field, hence the need for atomic<T*>
                 std::atomic<node_counter> node_count;   // reference count operations certainly need be atomic as they are read/written by multiple threads
-                counted_node_pointer next;              // next is only ever modified by a single thread, so atomicity is not needed.
+                std::atomic<counted_node_pointer> next; // set by the winning pusher or by any pusher helping it, hence atomic
+                typename value_ops::slot value;         // the element itself in value_storage::in_node mode, empty otherwise
+                node* next_retired;                     // link in the deferred list while a pop_bulk() may still read the node
 
                 node()
                 {
-                    next = {0,nullptr};
+                    reset();
+                }
+
+                // a recycled node is only reset once both of its counts reached 0, so no other thread can see it
+                void reset() noexcept
+                {
+                    next.store({0,nullptr});
 
                     node_counter initial_count;
                     initial_count.internal_count = 0;
@@ -74,34 +248,133 @@ namespace amtl
                     node_count.store(initial_count);
 
                     data = nullptr;
-                }
-
-                void release_reference()
-                {
-                    node_counter new_counter;
-                    node_counter old_counter = node_count.load();
-                    do
-                    {
-                        new_counter = old_counter;
-                        --new_counter.internal_count;
-                    }while(! node_count.compare_exchange_strong(old_counter,new_counter));
-
-                    if(!new_counter.internal_count && !new_counter.external_counters)
-                    {
-                        delete this; 
-                    }
+                    next_retired = nullptr;
                 }
             };
 
+            // external_count is pointer sized so the struct has no padding: compare_exchange compares the object
+            // representation, and indeterminate padding bytes would make CAS on next fail spuriously.
             struct counted_node_pointer
             {
-                int external_count;
+                std::intptr_t external_count;
                 node* node_ptr;
             };
 
             std::atomic<counted_node_pointer> head;
             std::atomic<counted_node_pointer> tail;
 
+            // retired nodes waiting to be reused by push(); null when node caching is disabled
+            std::unique_ptr<BoundedMPMCQueue<node*>> free_nodes;
+
+            // pop_bulk() walks nodes past head that it holds no reference to. While any pop_bulk() is in
+            // flight, retired nodes are parked on deferred_nodes instead of being reused or freed, and the
+            // last pop_bulk() to leave hands them on (the same scheme as the "threads in pop" reclamation of
+            // a lock-free stack).
+            std::atomic<int> bulk_poppers;
+            std::atomic<node*> deferred_nodes;
+
+            static std::unique_ptr<BoundedMPMCQueue<node*>> make_free_list(std::size_t max_cached_nodes)
+            {
+                if(max_cached_nodes == 0)
+                {
+                    return {};
+                }
+
+                std::size_t capacity = 2;
+                while(capacity < max_cached_nodes)
+                {
+                    capacity <<= 1;
+                }
+                return std::unique_ptr<BoundedMPMCQueue<node*>>{new BoundedMPMCQueue<node*>(capacity)};
+            }
+
+            node* acquire_node()
+            {
+                node* recycled;
+                if(free_nodes && free_nodes->try_pop(recycled))
+                {
+                    recycled->reset();
+                    return recycled;
+                }
+                return new node;
+            }
+
+            // called by whichever thread brought both counts of node_ptr to 0.
+            // The free list never dereferences the pointers it holds, so a node can go back to it the moment
+            // nobody references it any more; if the list is full the node goes back to the allocator instead.
+            void retire_node(node* node_ptr) noexcept
+            {
+                if(bulk_poppers.load() != 0)
+                {
+                    defer_nodes(node_ptr,node_ptr);
+                    return;
+                }
+                recycle_node(node_ptr);
+            }
+
+            void recycle_node(node* node_ptr) noexcept
+            {
+                if(!free_nodes || !free_nodes->try_push(node_ptr))
+                {
+                    delete node_ptr;
+                }
+            }
+
+            void defer_nodes(node* first, node* last) noexcept
+            {
+                last->next_retired = deferred_nodes.load();
+                while(! deferred_nodes.compare_exchange_weak(last->next_retired,first))
+                {
+                }
+            }
+
+            void leave_bulk_pop() noexcept
+            {
+                if(bulk_poppers.load() != 1)
+                {
+                    --bulk_poppers;
+                    return;
+                }
+
+                node* claimed = deferred_nodes.exchange(nullptr);
+                if(--bulk_poppers == 0)
+                {
+                    // nobody else can be walking these any more
+                    while(claimed)
+                    {
+                        node* next = claimed->next_retired;
+                        recycle_node(claimed);
+                        claimed = next;
+                    }
+                }
+                else if(claimed)
+                {
+                    // another pop_bulk() started meanwhile and may still see them
+                    node* last = claimed;
+                    while(last->next_retired)
+                    {
+                        last = last->next_retired;
+                    }
+                    defer_nodes(claimed,last);
+                }
+            }
+
+            void release_reference(node* node_ptr) noexcept
+            {
+                node_counter new_counter;
+                node_counter old_counter = node_ptr->node_count.load();
+                do
+                {
+                    new_counter = old_counter;
+                    --new_counter.internal_count;
+                }while(! node_ptr->node_count.compare_exchange_strong(old_counter,new_counter));
+
+                if(!new_counter.internal_count && !new_counter.external_counters)
+                {
+                    retire_node(node_ptr);
+                }
+            }
+
             void increase_ref_count(counted_node_pointer& old_node, std::atomic<counted_node_pointer>& marker) noexcept
             {
                 // spin in a CAS loop until the marker external count can be properly incremented by this thread
@@ -120,7 +393,7 @@ namespace amtl
 
             void free_external_count(counted_node_pointer& winner_thread_node) noexcept
             {
-                const int num_increase = winner_thread_node.external_count - 2;
+                const int num_increase = static_cast<int>(winner_thread_node.external_count - 2);
 
                 node* const node_ptr = winner_thread_node.node_ptr;
 
@@ -136,24 +409,75 @@ namespace amtl
 
                 if(!new_count.internal_count && !new_count.external_counters)
                 {
-                    delete node_ptr;
+                    retire_node(node_ptr);
                 }
             }
 
-            // push_impl is the internal worker function that actually pushes data onto the queue.
-            // it does so by atomically CAS-ing tail's node_ptr->data field. If a thread can swap
-            // node_ptr->data from nullptr to valid data, that thread is now responsible for moving tail
+            // set_new_tail swings tail from old_tail to new_tail, unless another thread already did it for us.
+            // Whoever actually moved tail off the node gives up tail's external count on it, everyone else
+            // only drops the reference they took.
+            // Returns true if this thread was the one that moved it.
+            bool set_new_tail(counted_node_pointer& old_tail, const counted_node_pointer& new_tail) noexcept
+            {
+                node* const current_tail_ptr = old_tail.node_ptr;
+                while(! tail.compare_exchange_weak(old_tail,new_tail) && old_tail.node_ptr == current_tail_ptr)
+                {
+                }
 
-            // other threads must keep spinning until tail is updated.
-            // TODO: Implement helping-threads that create dummy nodes, push tail.
+                if(old_tail.node_ptr == current_tail_ptr)
+                {
+                    free_external_count(old_tail);
+                    return true;
+                }
 
+                release_reference(current_tail_ptr);
+                return false;
+            }
 
-            void push_impl(std::unique_ptr<node> node_ptr, std::unique_ptr<T> data_ptr) noexcept
+            // release_unvisited gives up the count a side (head or tail) would have released had it ever
+            // pointed at node_ptr. Nodes in the middle of a bulk chain are passed over by tail in one step
+            // and by head in one step, so the winner releases that side's counter on their behalf.
+            void release_unvisited(node* node_ptr) noexcept
             {
+                counted_node_pointer never_visited = {2,node_ptr};
+                free_external_count(never_visited);
+            }
 
-                counted_node_pointer  new_tail;
-                new_tail.external_count = 1;
-                new_tail.node_ptr = node_ptr.get();
+            // help_tail_forward keeps swinging tail along already linked nodes until it reaches last or a node
+            // that has no successor yet. Used by push_bulk() when helpers moved tail into the middle of its chain.
+            void help_tail_forward(node* last) noexcept
+            {
+                for(;;)
+                {
+                    counted_node_pointer old_tail = tail.load();
+                    increase_ref_count(old_tail,tail);
+
+                    const counted_node_pointer old_next = old_tail.node_ptr->next.load();
+                    if(old_tail.node_ptr == last || ! old_next.node_ptr)
+                    {
+                        release_reference(old_tail.node_ptr);
+                        return;
+                    }
+
+                    set_new_tail(old_tail,old_next);
+                }
+            }
+
+            // push_impl is the internal worker function that actually pushes data onto the queue.
+            // it does so by atomically CAS-ing tail's node_ptr->data field. If a thread can swap
+            // node_ptr->data from nullptr to valid data, that thread now owns the node and links its new
+            // dummy node behind it.
+
+            // a thread that loses the data race does not wait for the winner: it tries to link its own dummy
+            // node as tail's next and to swing tail itself, then retries on the new tail (Michael-Scott helping).
+            // That way a winner that gets preempted between claiming the node and moving tail stalls nobody.
+            // Whichever dummy gets linked first is used, the loser of that race keeps (or recycles) its own.
+
+            void push_impl(node* node_ptr, typename value_ops::holder& data)
+            {
+                counted_node_pointer  new_next;
+                new_next.external_count = 1;
+                new_next.node_ptr = node_ptr;
 
                 counted_node_pointer old_tail = tail.load();
                 for(;;)
@@ -162,24 +486,95 @@ namespace amtl
                     increase_ref_count(old_tail,tail);
                     T* old_data = nullptr;
 
-                    if(old_tail.node_ptr->data.compare_exchange_strong(old_data,data_ptr.get()))
+                    if(old_tail.node_ptr->data.compare_exchange_strong(old_data,data.claim()))
                     {
-                        old_tail.node_ptr->next = new_tail;
-                        old_tail = tail.exchange(new_tail);
-                        free_external_count(old_tail);
-                        data_ptr.release(); 
-                        node_ptr.release();
+                        data.commit(old_tail.node_ptr->data,old_tail.node_ptr->value);
+
+                        counted_node_pointer old_next = {0,nullptr};
+                        if(! old_tail.node_ptr->next.compare_exchange_strong(old_next,new_next))
+                        {
+                            // a helper already linked a dummy behind our node, ours is not needed
+                            retire_node(new_next.node_ptr);
+                            new_next = old_next;
+                        }
+
+                        set_new_tail(old_tail,new_next);
                         break;
                     
                     }
 
-                    old_tail.node_ptr->release_reference();
-                    
+                    // help the winner along
+                    counted_node_pointer old_next = {0,nullptr};
+                    if(old_tail.node_ptr->next.compare_exchange_strong(old_next,new_next))
+                    {
+                        old_next = new_next;
+                        new_next.node_ptr = nullptr;
+                    }
+                    set_new_tail(old_tail,old_next);
+
+                    if(! new_next.node_ptr)
+                    {
+                        // our dummy went to the winner, we need a fresh one for the next attempt
+                        new_next.node_ptr = acquire_node();
+                    }
+                }
+            }
+
+            // pop_impl detaches the head node and hands its value to extract before the node is released.
+            // Returns false if the queue was empty.
+            template<class Extract>
+            bool pop_impl(Extract&& extract)
+            {
+                counted_node_pointer old_head = head.load();
+                for(;;)
+                {
+                    increase_ref_count(old_head,head);
+                    node* ptr = old_head.node_ptr;
+
+                    if(ptr == tail.load().node_ptr)
+                    {
+                        // empty queue
+                        release_reference(ptr);
+                        return false;
+                    }
+
+                    if(head.compare_exchange_strong(old_head,ptr->next.load()))
+                    {
+                        // the node goes back even if extract throws, the value is gone either way
+                        struct release_on_exit
+                        {
+                            MPMCQueue* queue;
+                            counted_node_pointer& winner;
+                            ~release_on_exit() { queue->free_external_count(winner); }
+                        } guard{this,old_head};
+
+                        extract(value_ops::published(ptr->data));
+                        return true;
+                    }
+
+                    release_reference(ptr);
+                }
+            }
+
+            // the i-th node detached by pop_bulk(): only the first one was ever head
+            void release_detached(counted_node_pointer& old_head, node* node_ptr, std::size_t i) noexcept
+            {
+                if(i == 0)
+                {
+                    free_external_count(old_head);
+                }
+                else
+                {
+                    release_unvisited(node_ptr);
                 }
             }
 
         public:
-            MPMCQueue()
+            // max_cached_nodes caps how many retired nodes the queue keeps around for reuse, 0 disables caching.
+            explicit MPMCQueue(std::size_t max_cached_nodes = 1024) :
+                free_nodes(make_free_list(max_cached_nodes)),
+                bulk_poppers(0),
+                deferred_nodes(nullptr)
             {
                 std::unique_ptr<node> initial_node{new node};
 
@@ -203,20 +598,34 @@ namespace amtl
                 node* tail_ptr = tail.load().node_ptr;
 
                 // if there's any remaining data items in the queue upon destruction,
-                // iterate through the linked list and manage each T* by wrapping it in a unique_ptr.
+                // iterate through the linked list and destroy each T.
                 // The loop should only extend up until tail's ptr because the class invariants
                 // maintain that after a succesful call to push(), tail points to a dummy node
                 // without any valid data.
                 while(head_ptr != tail_ptr)
                 {
-                    node* ptr_next = head_ptr->next.node_ptr;
-                    std::unique_ptr<T> head_data{head_ptr->data.load()};
+                    node* ptr_next = head_ptr->next.load().node_ptr;
+                    value_ops::destroy(head_ptr->data.load());
                     delete head_ptr;
                     head_ptr = ptr_next;
 
                 }
                 // no more data to delete, just delete tail's node
                 delete head_ptr;
+
+                node* deferred = deferred_nodes.load();
+                while(deferred)
+                {
+                    node* next = deferred->next_retired;
+                    delete deferred;
+                    deferred = next;
+                }
+
+                node* recycled;
+                while(free_nodes && free_nodes->try_pop(recycled))
+                {
+                    delete recycled;
+                }
             }
 
 
@@ -229,40 +638,278 @@ namespace amtl
             template<typename... CtorArgs>
             void push(CtorArgs&&... ctor_args)
             {
-                std::unique_ptr<node> node_ptr{ new node};
-                std::unique_ptr<T>    data_ptr{ new T{std::forward<CtorArgs>(ctor_args)...} };
-                push_impl(std::move(node_ptr),std::move(data_ptr));
+                typename value_ops::holder data{std::forward<CtorArgs>(ctor_args)...};
+                node* node_ptr = acquire_node();
+                push_impl(node_ptr,data);
+                this->not_empty.NotifyOne();
             }
             
 
             // pop will attempt to remove the next item in the queue, and return a unique_ptr to the data.
             // If the queue is full, a default-constructed unique_ptr<T> is returned, instead.
-            // pop will not emit an exception.
+            // pop will not emit an exception in value_storage::heap mode.
+
+            std::unique_ptr<T> pop() noexcept(Storage == value_storage::heap)
+            {
+                std::unique_ptr<T> data;
+                pop_impl([&](T* value){ data = value_ops::take(value); });
+                return data;
+            }
 
-            std::unique_ptr<T> pop() noexcept
+            // push_bulk appends the items of [first,last) in order, constructing each T from *it.
+            // The items are linked into a private chain of nodes first, and normally the whole chain is published
+            // with a single claim of the tail node and a single tail update. The batch keeps its order but is not
+            // atomic: when a concurrent pusher links its own dummy behind the node the batch just filled, the next
+            // item is retried on that dummy, and pushes from other threads may land in between.
+
+            // push_bulk provides the strong exception safety guarantee
+            template<typename InputIt>
+            void push_bulk(InputIt first, InputIt last)
             {
+                if(first == last)
+                {
+                    return;
+                }
+
+                // the first item goes into the current tail node; the chain, linked through next, holds the nodes
+                // for the remaining items followed by the new dummy tail
+                typename value_ops::holder data{*first};
+                node* chain_first = nullptr;
+                node* chain_last = nullptr;
+                node* spare = nullptr;
+
+                try
+                {
+                    for(;;)
+                    {
+                        node* const link = acquire_node();
+                        if(chain_last)
+                        {
+                            chain_last->next.store({1,link});
+                        }
+                        else
+                        {
+                            chain_first = link;
+                        }
+                        chain_last = link;
+
+                        if(++first == last)
+                        {
+                            break;
+                        }
+
+                        typename value_ops::holder item{*first};
+                        link->data.store(item.claim());
+                        item.commit(link->data,link->value);
+                    }
+                    spare = acquire_node();
+                }
+                catch(...)
+                {
+                    for(node* n = chain_first; n; )
+                    {
+                        node* const next = n->next.load().node_ptr;
+                        if(T* value = n->data.load())
+                        {
+                            value_ops::destroy(value);
+                        }
+                        delete n;
+                        n = next;
+                    }
+                    throw;
+                }
+
+                node* start = chain_first;
+                counted_node_pointer old_tail = tail.load();
+                for(;;)
+                {
+                    increase_ref_count(old_tail,tail);
+                    T* old_data = nullptr;
+
+                    if(old_tail.node_ptr->data.compare_exchange_strong(old_data,data.claim()))
+                    {
+                        data.commit(old_tail.node_ptr->data,old_tail.node_ptr->value);
+
+                        counted_node_pointer old_next = {0,nullptr};
+                        const counted_node_pointer chain_head = {1,start};
+                        if(old_tail.node_ptr->next.compare_exchange_strong(old_next,chain_head))
+                        {
+                            if(set_new_tail(old_tail,{1,chain_last}))
+                            {
+                                // tail jumped over the middle of the chain. Each node's tail side count is still
+                                // ours, so it stays alive until we release it, but not after: read next first
+                                for(node* n = start; n != chain_last; )
+                                {
+                                    node* const next = n->next.load().node_ptr;
+                                    release_unvisited(n);
+                                    n = next;
+                                }
+                            }
+                            else
+                            {
+                                // a helper moved tail onto the chain's first node, walk it the rest of the way
+                                help_tail_forward(chain_last);
+                            }
+                            break;
+                        }
+
+                        // a helper linked its own dummy behind the node we filled: that dummy becomes the tail to
+                        // fill next, with the value from the first node of the chain
+                        set_new_tail(old_tail,old_next);
+                        if(start == chain_last)
+                        {
+                            // only the dummy was left, every item is in the queue
+                            retire_node(start);
+                            break;
+                        }
+                        node* const next = start->next.load().node_ptr;
+                        data.adopt(start->data.load());
+                        retire_node(start);
+                        start = next;
+                        old_tail = tail.load();
+                        continue;
+                    }
+
+                    // help the winner along like push_impl does. Once our spare dummy is given away we only help
+                    // with dummies the winner or others already linked: nothing may throw after the first item went in
+                    counted_node_pointer old_next = {0,nullptr};
+                    if(spare && old_tail.node_ptr->next.compare_exchange_strong(old_next,{1,spare}))
+                    {
+                        old_next = {1,spare};
+                        spare = nullptr;
+                    }
+                    else if(! spare)
+                    {
+                        old_next = old_tail.node_ptr->next.load();
+                    }
+
+                    if(old_next.node_ptr)
+                    {
+                        set_new_tail(old_tail,old_next);
+                    }
+                    else
+                    {
+                        release_reference(old_tail.node_ptr);
+                        std::this_thread::yield();
+                        old_tail = tail.load();
+                    }
+                }
+
+                if(spare)
+                {
+                    retire_node(spare);
+                }
+
+                this->not_empty.NotifyAll();
+            }
+
+            // pop_bulk removes up to max items from the front of the queue, writing them to out in order, and
+            // returns how many it removed. The items are detached with a single CAS on head.
+
+            // if writing to out throws, the items not yet written are destroyed and the exception propagates.
+            template<typename OutputIt>
+            std::size_t pop_bulk(OutputIt out, std::size_t max)
+            {
+                if(max == 0)
+                {
+                    return 0;
+                }
+
+                ++bulk_poppers;
+                struct leave_on_exit
+                {
+                    MPMCQueue* queue;
+                    ~leave_on_exit() { queue->leave_bulk_pop(); }
+                } leave{this};
+
+                std::size_t count = 0;
                 counted_node_pointer old_head = head.load();
                 for(;;)
                 {
                     increase_ref_count(old_head,head);
-                    node* ptr = old_head.node_ptr;
+                    node* const ptr = old_head.node_ptr;
+                    node* const tail_ptr = tail.load().node_ptr;
 
-                    if(ptr == tail.load().node_ptr)
+                    if(ptr == tail_ptr)
                     {
                         // empty queue
-                        ptr->release_reference();
-                        return {};
+                        release_reference(ptr);
+                        return 0;
+                    }
+
+                    // every node from head up to the tail we just read was in the queue after we registered
+                    // as a bulk popper, so even if a concurrent pop() retires it, it stays readable
+                    count = 0;
+                    node* current = ptr;
+                    counted_node_pointer new_head;
+                    for(;;)
+                    {
+                        ++count;
+                        new_head = current->next.load();
+                        if(count == max || new_head.node_ptr == tail_ptr)
+                        {
+                            break;
+                        }
+                        current = new_head.node_ptr;
                     }
 
-                    if(head.compare_exchange_strong(old_head,ptr->next))
+                    if(head.compare_exchange_strong(old_head,new_head))
                     {
-                        std::unique_ptr<T> data(ptr->data.load());
-                        free_external_count(old_head);
-                        return data;
+                        break;
                     }
 
-                    ptr->release_reference();
+                    release_reference(ptr);
+                }
+
+                // old_head is the winning reference to the first node, the others were never head. A detached node
+                // may be retired as soon as it is released, so its successor is read before
+                node* current = old_head.node_ptr;
+                std::size_t i = 0;
+                try
+                {
+                    for(; i != count; ++i)
+                    {
+                        node* const next = current->next.load().node_ptr;
+                        T* const value = value_ops::published(current->data);
+                        struct destroy_on_exit
+                        {
+                            T* value;
+                            ~destroy_on_exit() { value_ops::destroy(value); }
+                        } guard{value};
+
+                        *out = std::move(*value);
+                        ++out;
+                        release_detached(old_head,current,i);
+                        current = next;
+                    }
+                }
+                catch(...)
+                {
+                    // the item that threw was destroyed by its guard, the ones after it never reach out
+                    for(const std::size_t failed = i; i != count; ++i)
+                    {
+                        node* const next = current->next.load().node_ptr;
+                        if(i != failed)
+                        {
+                            value_ops::destroy(value_ops::published(current->data));
+                        }
+                        release_detached(old_head,current,i);
+                        current = next;
+                    }
+                    throw;
                 }
+
+                return count;
+            }
+
+
+            // try_pop will attempt to remove the next item in the queue and move it into out.
+            // Returns false, leaving out untouched, if the queue is empty.
+            // try_pop will not emit an exception as long as T's move assignment does not.
+
+            bool try_pop(T& out) noexcept(std::is_nothrow_move_assignable<T>::value)
+            {
+                return pop_impl([&](T* value){ value_ops::take(value,out); });
             }
             
     };
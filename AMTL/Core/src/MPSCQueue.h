@@ -0,0 +1,298 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+#include "BoundedMPMCQueue.h"
+#include "CpuRelax.h"
+#include "WaitableQueue.h"
+
+namespace amtl
+{
+
+    // mpsc_hook is the link an object needs to be put on an IntrusiveMPSCQueue.
+    struct mpsc_hook
+    {
+        std::atomic<mpsc_hook*> mpsc_next;
+
+        mpsc_hook() : mpsc_next(nullptr) {}
+    };
+
+    /*
+        IntrusiveMPSCQueue is Dmitry Vyukov's intrusive multi-producer,single-consumer queue.
+
+        push() is wait-free: one exchange on head plus a release store linking the previous node. pop() never
+        uses a CAS. The price is a short window in which a producer has swung head but not yet linked its
+        node; a pop() that runs into it returns nullptr even though the queue is not empty, so the consumer
+        must be prepared to retry (the owning queue's producer always follows up with a notification).
+
+        Node must derive from mpsc_hook. The queue does not own the nodes.
+    */
+    template<class Node>
+    class IntrusiveMPSCQueue
+    {
+        private:
+
+            constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+            alignas(CACHE_LINE_SIZE) std::atomic<mpsc_hook*> head;     // producers
+            alignas(CACHE_LINE_SIZE) mpsc_hook* tail;                  // consumer
+            mpsc_hook stub;
+
+            void push_hook(mpsc_hook* hook) noexcept
+            {
+                hook->mpsc_next.store(nullptr,std::memory_order_relaxed);
+                mpsc_hook* prev = head.exchange(hook,std::memory_order_acq_rel);
+                prev->mpsc_next.store(hook,std::memory_order_release);
+            }
+
+        public:
+            IntrusiveMPSCQueue() :
+                head(&stub),
+                tail(&stub)
+            {
+            }
+
+            IntrusiveMPSCQueue(const IntrusiveMPSCQueue&) = delete;
+            IntrusiveMPSCQueue& operator=(const IntrusiveMPSCQueue&) = delete;
+
+            // any thread
+            void push(Node* node) noexcept
+            {
+                push_hook(node);
+            }
+
+            // consumer thread only. Returns nullptr if the queue is empty or a push is half-way through.
+            Node* pop() noexcept
+            {
+                mpsc_hook* current = tail;
+                mpsc_hook* next = current->mpsc_next.load(std::memory_order_acquire);
+
+                if(current == &stub)
+                {
+                    if(! next)
+                    {
+                        return nullptr;
+                    }
+                    tail = next;
+                    current = next;
+                    next = next->mpsc_next.load(std::memory_order_acquire);
+                }
+
+                if(next)
+                {
+                    tail = next;
+                    return static_cast<Node*>(current);
+                }
+
+                if(current != head.load(std::memory_order_acquire))
+                {
+                    // a producer swung head but has not linked its node yet
+                    return nullptr;
+                }
+
+                // current is the last node: put the stub behind it so current can be handed out
+                push_hook(&stub);
+
+                next = current->mpsc_next.load(std::memory_order_acquire);
+                if(next)
+                {
+                    tail = next;
+                    return static_cast<Node*>(current);
+                }
+                return nullptr;
+            }
+
+            // consumer thread only; may report a half-pushed queue as empty
+            bool empty() const noexcept
+            {
+                return tail == &stub && ! stub.mpsc_next.load(std::memory_order_acquire);
+            }
+    };
+
+    /*
+        MPSCQueue is a multi-producer,single-consumer queue with the same interface as MPMCQueue, built on
+        IntrusiveMPSCQueue. Elements are stored inline in their nodes, and nodes are recycled through a bounded
+        free list like MPMCQueue's, so the steady state does not allocate.
+
+        The behavior is undefined if more than one thread pops concurrently.
+    */
+    template<class T>
+    class MPSCQueue : public detail::waitable_queue<MPSCQueue<T>,T>
+    {
+        private:
+
+            static_assert(std::is_nothrow_move_constructible<T>::value,"MPSCQueue requires a nothrow move constructible T");
+
+            struct node : mpsc_hook
+            {
+                typename std::aligned_storage<sizeof(T),alignof(T)>::type storage;
+
+                T* value() noexcept { return reinterpret_cast<T*>(&storage); }
+            };
+
+            IntrusiveMPSCQueue<node> nodes;
+            std::unique_ptr<BoundedMPMCQueue<node*>> free_nodes;
+
+            node* acquire_node()
+            {
+                node* recycled;
+                if(free_nodes && free_nodes->try_pop(recycled))
+                {
+                    return recycled;
+                }
+                return new node;
+            }
+
+            void retire_node(node* node_ptr) noexcept
+            {
+                if(!free_nodes || !free_nodes->try_push(node_ptr))
+                {
+                    delete node_ptr;
+                }
+            }
+
+            static std::unique_ptr<BoundedMPMCQueue<node*>> make_free_list(std::size_t max_cached_nodes)
+            {
+                if(max_cached_nodes == 0)
+                {
+                    return {};
+                }
+
+                std::size_t capacity = 2;
+                while(capacity < max_cached_nodes)
+                {
+                    capacity <<= 1;
+                }
+                return std::unique_ptr<BoundedMPMCQueue<node*>>{new BoundedMPMCQueue<node*>(capacity)};
+            }
+
+            // pop_node returns the front node, or nullptr if the queue is empty. A push that is half-way through
+            // is only two instructions from done, so the consumer waits it out instead of reporting empty.
+            node* pop_node() noexcept
+            {
+                node* front = nodes.pop();
+                while(! front && ! nodes.empty())
+                {
+                    CpuRelax();
+                    front = nodes.pop();
+                }
+                return front;
+            }
+
+        public:
+            // max_cached_nodes caps how many retired nodes the queue keeps around for reuse, 0 disables caching.
+            explicit MPSCQueue(std::size_t max_cached_nodes = 1024) :
+                free_nodes(make_free_list(max_cached_nodes))
+            {
+            }
+
+            ~MPSCQueue()
+            {
+                while(node* front = nodes.pop())
+                {
+                    front->value()->~T();
+                    delete front;
+                }
+
+                node* recycled;
+                while(free_nodes && free_nodes->try_pop(recycled))
+                {
+                    delete recycled;
+                }
+            }
+
+            // push constructs a T from the arguments and appends it. Any thread.
+
+            // push provides the strong exception safety guarantee
+            template<typename... CtorArgs>
+            void push(CtorArgs&&... ctor_args)
+            {
+                T value{std::forward<CtorArgs>(ctor_args)...};
+                node* node_ptr = acquire_node();
+                new (node_ptr->value()) T(std::move(value));
+                nodes.push(node_ptr);
+
+                // seq_cst so a consumer about to park either sees the item or is seen by the notify
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                this->not_empty.NotifyOne();
+            }
+
+            template<typename InputIt>
+            void push_bulk(InputIt first, InputIt last)
+            {
+                for(; first != last; ++first)
+                {
+                    push(*first);
+                }
+            }
+
+            // try_pop moves the front item into out and returns true, or returns false if the queue is empty.
+            // Consumer thread only.
+            bool try_pop(T& out) noexcept(std::is_nothrow_move_assignable<T>::value)
+            {
+                node* front = pop_node();
+                if(! front)
+                {
+                    return false;
+                }
+
+                struct release_on_exit
+                {
+                    MPSCQueue* queue;
+                    node* front;
+                    ~release_on_exit() { front->value()->~T(); queue->retire_node(front); }
+                } guard{this,front};
+
+                out = std::move(*front->value());
+                return true;
+            }
+
+            // pop returns the front item, or an empty unique_ptr if the queue is empty. Consumer thread only.
+            std::unique_ptr<T> pop()
+            {
+                node* front = pop_node();
+                if(! front)
+                {
+                    return {};
+                }
+
+                struct release_on_exit
+                {
+                    MPSCQueue* queue;
+                    node* front;
+                    ~release_on_exit() { front->value()->~T(); queue->retire_node(front); }
+                } guard{this,front};
+
+                return std::unique_ptr<T>{ new T(std::move(*front->value())) };
+            }
+
+            template<typename OutputIt>
+            std::size_t pop_bulk(OutputIt out, std::size_t max)
+            {
+                std::size_t count = 0;
+                for(; count != max; ++count)
+                {
+                    node* front = pop_node();
+                    if(! front)
+                    {
+                        break;
+                    }
+
+                    struct release_on_exit
+                    {
+                        MPSCQueue* queue;
+                        node* front;
+                        ~release_on_exit() { front->value()->~T(); queue->retire_node(front); }
+                    } guard{this,front};
+
+                    *out = std::move(*front->value());
+                    ++out;
+                }
+                return count;
+            }
+    };
+}
@@ -22,8 +22,14 @@
 // THE SOFTWARE.
 //
 
+#pragma once
+
 #include <mutex>
 #include <memory>
+#include <chrono>
+
+#include "CpuRelax.h"
+#include "EventCount.h"
 
 template<class T>
 class MTQueue
@@ -42,6 +48,12 @@ class MTQueue
   std::mutex head_mut alignas(CACHE_LINE_SIZE);
   std::mutex tail_mut alignas(CACHE_LINE_SIZE);
 
+  // consumers blocked in wait_pop(); push() only reads its waiter count when nobody waits
+  EventCount not_empty;
+
+  // how many times wait_pop() retries before it parks
+  constexpr static int WAIT_SPIN_COUNT = 64;
+
   /*
     get_tail() serves as a convenience function for taking a short lived
     lock and returning the current value of tail. Since this is scoped,
@@ -77,6 +89,22 @@ class MTQueue
       return old_head;
     }
 
+  /*
+    spin_pop() retries pop() WAIT_SPIN_COUNT times, so a consumer whose
+    producer is about to push does not pay for parking and waking up.
+    Returns a default-constructed shared_ptr if nothing arrived.
+  */
+  std::shared_ptr<T> spin_pop()
+    {
+      for(int spin = 0; spin != WAIT_SPIN_COUNT; ++spin)
+	{
+	  if(auto data = pop())
+	    return data;
+	  CpuRelax();
+	}
+      return nullptr;
+    }
+
  public:
  MTQueue() : head(new node) , tail(head.get()) {}
   MTQueue(const MTQueue&) = delete;
@@ -100,11 +128,14 @@ class MTQueue
       std::shared_ptr<T>    new_data(std::make_shared<T>(std::move(val)));
       std::unique_ptr<node> new_node(new node);
       node*   new_tail(new_node.get()); 
-      std::lock_guard<std::mutex> lock(tail_mut);
+      {
+	std::lock_guard<std::mutex> lock(tail_mut);
       
-      tail->data = std::move(new_data);
-      tail->next = std::move(new_node);
-      tail = new_tail;
+	tail->data = std::move(new_data);
+	tail->next = std::move(new_node);
+	tail = new_tail;
+      }
+      not_empty.NotifyOne();
     }
 
   /*
@@ -121,4 +152,60 @@ class MTQueue
       return old_head ? old_head->data : std::shared_ptr<T>{} ;
     }
 
+  /*
+    wait_pop() is pop() for consumers that would rather sleep than spin.
+    If the queue is empty it retries briefly, then parks the calling
+    thread until a push() arrives, and returns the front element.
+
+    wait_pop() provides the strong exception safety guarantee
+  */
+  std::shared_ptr<T> wait_pop()
+    {
+      if(auto data = spin_pop())
+	return data;
+
+      for(;;)
+	{
+	  if(auto data = pop())
+	    return data;
+
+	  const EventCount::Key key = not_empty.PrepareWait();
+	  if(auto data = pop())
+	    {
+	      not_empty.CancelWait();
+	      return data;
+	    }
+	  not_empty.Wait(key);
+	}
+    }
+
+  /*
+    wait_pop_for() is wait_pop() with a timeout. If nothing arrives
+    in time, a default-constructed shared_ptr is returned.
+
+    wait_pop_for() provides the strong exception safety guarantee
+  */
+  template<class Rep, class Period>
+    std::shared_ptr<T> wait_pop_for(const std::chrono::duration<Rep,Period>& timeout)
+    {
+      const auto deadline = std::chrono::steady_clock::now() + timeout;
+      if(auto data = spin_pop())
+	return data;
+
+      for(;;)
+	{
+	  if(auto data = pop())
+	    return data;
+
+	  const EventCount::Key key = not_empty.PrepareWait();
+	  if(auto data = pop())
+	    {
+	      not_empty.CancelWait();
+	      return data;
+	    }
+	  if(!not_empty.WaitFor(key, deadline - std::chrono::steady_clock::now()))
+	    return pop();
+	}
+    }
+
 };
@@ -0,0 +1,151 @@
+#include "NumaTopology.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <sched.h>
+#endif
+
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+//-------------------------------------------------------------------------------------------------
+namespace
+{
+	std::vector<unsigned> AllowedCpus()
+	{
+		std::vector<unsigned> cpus;
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			{
+				if (CPU_ISSET(cpu, &set))
+					cpus.push_back(cpu);
+			}
+		}
+#endif
+		return cpus;
+	}
+
+	// node ids listed in sysfs, sorted
+	std::vector<unsigned> ListNodes()
+	{
+		std::vector<unsigned> ids;
+#if defined(__linux__)
+		DIR* dir = opendir(SYSFS_NODE_DIR);
+		if (!dir)
+			return ids;
+
+		while (dirent* entry = readdir(dir))
+		{
+			const char* name = entry->d_name;
+			if (name[0] != 'n' || name[1] != 'o' || name[2] != 'd' || name[3] != 'e')
+				continue;
+
+			char* end = nullptr;
+			const unsigned long id = std::strtoul(name + 4, &end, 10);
+			if (end != name + 4 && *end == '\0')
+				ids.push_back(static_cast<unsigned>(id));
+		}
+		closedir(dir);
+		std::sort(ids.begin(), ids.end());
+#endif
+		return ids;
+	}
+}
+//-------------------------------------------------------------------------------------------------
+const NumaTopology& NumaTopology::System()
+{
+	static const NumaTopology topology;
+	return topology;
+}
+//-------------------------------------------------------------------------------------------------
+NumaTopology::NumaTopology()
+{
+	const std::vector<unsigned> allowed = AllowedCpus();
+
+	for (unsigned id : ListNodes())
+	{
+		std::ifstream file(SYSFS_NODE_DIR "/node" + std::to_string(id) + "/cpulist");
+		std::string list;
+		if (!std::getline(file, list))
+			continue;
+
+		NumaNode node;
+		node.m_Id = id;
+		for (unsigned cpu : ParseCpuList(list.c_str()))
+		{
+			if (allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+				node.m_Cpus.push_back(cpu);
+		}
+
+		// memory-only nodes and nodes outside our cpuset cannot host a worker
+		if (!node.m_Cpus.empty())
+			m_Nodes.push_back(std::move(node));
+	}
+
+	if (m_Nodes.empty())
+	{
+		NumaNode node;
+		node.m_Id = 0;
+		node.m_Cpus = allowed;
+		m_Nodes.push_back(std::move(node));
+	}
+
+	for (const NumaNode& node : m_Nodes)
+	{
+		for (unsigned cpu : node.m_Cpus)
+		{
+			if (cpu >= m_CpuToNode.size())
+				m_CpuToNode.resize(cpu + 1, -1);
+			m_CpuToNode[cpu] = static_cast<int>(node.m_Id);
+		}
+	}
+}
+//-------------------------------------------------------------------------------------------------
+int NumaTopology::CurrentNode() const
+{
+#if defined(__linux__)
+	const int cpu = sched_getcpu();
+	if (cpu >= 0)
+		return NodeOfCpu(static_cast<unsigned>(cpu));
+#endif
+	return -1;
+}
+//-------------------------------------------------------------------------------------------------
+std::vector<unsigned> NumaTopology::ParseCpuList(const char* list)
+{
+	std::vector<unsigned> cpus;
+	const char* p = list;
+	while (*p)
+	{
+		char* end = nullptr;
+		const unsigned long first = std::strtoul(p, &end, 10);
+		if (end == p)
+			break;
+
+		unsigned long last = first;
+		p = end;
+		if (*p == '-')
+		{
+			last = std::strtoul(p + 1, &end, 10);
+			if (end == p + 1)
+				break;
+			p = end;
+		}
+
+		for (unsigned long cpu = first; cpu <= last; ++cpu)
+			cpus.push_back(static_cast<unsigned>(cpu));
+
+		if (*p != ',')
+			break;
+		++p;
+	}
+	return cpus;
+}
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,69 @@
+//
+// NUMA topology
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <vector>
+//-------------------------------------------------------------------------------------------------
+/*
+	NumaNode is one memory node together with the CPUs attached to it that the process may
+	run on. m_Id is the number the kernel uses (/sys/devices/system/node/node<m_Id>).
+*/
+struct NumaNode
+{
+	unsigned				m_Id;
+	std::vector<unsigned>	m_Cpus;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	NumaTopology is read once from /sys/devices/system/node and then shared by everyone.
+	Nodes without a usable CPU are left out; if sysfs is missing (non-Linux, containers
+	hiding it) the whole machine is reported as node 0.
+*/
+class NumaTopology
+{
+public:
+	static const NumaTopology& System();
+
+	const std::vector<NumaNode>& Nodes() const { return m_Nodes; }
+
+	// -1 for a CPU the topology does not know
+	int NodeOfCpu(unsigned cpu) const
+	{
+		return (cpu < m_CpuToNode.size()) ? m_CpuToNode[cpu] : -1;
+	}
+
+	// node of the CPU the calling thread runs on right now; -1 if unknown
+	int CurrentNode() const;
+
+	// parses a sysfs CPU list such as "0-3,8,10-11"
+	static std::vector<unsigned> ParseCpuList(const char* list);
+
+private:
+	NumaTopology();
+
+	std::vector<NumaNode>	m_Nodes;
+	std::vector<int>		m_CpuToNode;
+};
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,287 @@
+//
+// Parallel loops
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "TaskJoin.h"
+#include "TaskProcessor.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	ParallelFor and ParallelReduce run a loop over the integer range [first, last) on a
+	TaskProcessor and return when it is done.
+
+	The range is cut into chunks of `grain` indices. Grain 0 picks CHUNKS_PER_THREAD chunks per
+	worker (plus one share for the caller), enough slack to even out uneven chunks without
+	drowning short bodies in scheduling cost. The calling thread runs the first chunk itself and
+	hands the rest to the pool by halving: every task posts the upper half of its chunk range and
+	keeps the lower one, so thieves take big pieces and the owner works through small ones in
+	order. All tasks of one loop join on a single TaskJoin and the caller helps while waiting;
+	chunk tasks are pooled slots, so a loop does not allocate apart from the per-chunk results of
+	ParallelReduce.
+
+	The first exception thrown by the body is rethrown to the caller; chunks that have not started
+	by then are skipped. If a pool shutdown drops some of the chunks, the loop throws TaskDropped.
+*/
+template<class Index>
+class ParallelChunks
+{
+	static_assert(std::is_integral<Index>::value, "ParallelFor works on integer ranges");
+
+public:
+	constexpr static std::size_t CHUNKS_PER_THREAD = 8;
+
+	ParallelChunks(Index first, Index last, std::size_t grain, unsigned threads):
+		m_First(first),
+		m_Size(last > first ? static_cast<std::size_t>(last - first) : 0)
+	{
+		if (grain == 0)
+		{
+			const std::size_t target = (threads + 1) * CHUNKS_PER_THREAD;
+			grain = (m_Size + target - 1) / target;
+		}
+		m_Grain = std::max<std::size_t>(grain, 1);
+		m_Count = (m_Size + m_Grain - 1) / m_Grain;
+	}
+
+	std::size_t Count() const { return m_Count; }
+
+	Index Begin(std::size_t chunk) const { return static_cast<Index>(m_First + chunk * m_Grain); }
+	Index End(std::size_t chunk) const { return static_cast<Index>(m_First + std::min(m_Size, (chunk + 1) * m_Grain)); }
+
+private:
+	Index		m_First;
+	std::size_t	m_Size;
+	std::size_t	m_Grain;
+	std::size_t	m_Count;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	ParallelLoop is the state one loop shares between its tasks; Loop::RunChunk(chunk) does the
+	actual work.
+*/
+template<class Loop>
+class ParallelLoop
+{
+public:
+	explicit ParallelLoop(TaskProcessor& pool) : m_Pool(pool), m_Failed(false) {}
+
+	void Run(std::size_t chunks)
+	{
+		Spread(static_cast<Loop*>(this), 0, chunks);
+		m_Join.Wait(m_Pool);
+
+		if (m_Failed.load(std::memory_order_relaxed))
+			std::rethrow_exception(m_Error);
+	}
+
+protected:
+	bool Failed() const { return m_Failed.load(std::memory_order_relaxed); }
+
+	void Fail(std::exception_ptr error = std::current_exception())
+	{
+		bool expected = false;
+		if (m_Failed.compare_exchange_strong(expected, true, std::memory_order_relaxed))
+			m_Error = std::move(error);
+	}
+
+private:
+	// the chunks [m_Lo, m_Hi) handed to the pool
+	class SpreadTask
+	{
+	public:
+		SpreadTask(Loop* loop, std::size_t lo, std::size_t hi) : m_Loop(loop), m_Lo(lo), m_Hi(hi) {}
+
+		void operator()()
+		{
+			Spread(m_Loop, m_Lo, m_Hi);
+			m_Loop->m_Join.Done();
+		}
+
+		void OnDrop()
+		{
+			m_Loop->Fail(std::make_exception_ptr(TaskDropped()));
+			m_Loop->m_Join.Done();
+		}
+
+	private:
+		Loop*		m_Loop;
+		std::size_t	m_Lo;
+		std::size_t	m_Hi;
+	};
+
+	static void Spread(Loop* loop, std::size_t lo, std::size_t hi)
+	{
+		while (hi - lo > 1)
+		{
+			const std::size_t mid = lo + (hi - lo) / 2;
+
+			loop->m_Join.Add();
+			try
+			{
+				loop->m_Pool.Post(SpreadTask(loop, mid, hi));
+			}
+			catch (...)
+			{
+				// could not hand it out, so run the rest here
+				loop->m_Join.Done();
+				break;
+			}
+			hi = mid;
+		}
+
+		for (; lo < hi; ++lo)
+			loop->RunChunk(lo);
+	}
+
+	TaskProcessor&		m_Pool;
+	TaskJoin			m_Join;
+	std::atomic<bool>	m_Failed;
+	std::exception_ptr	m_Error;	// written once by whoever sets m_Failed, read after the join
+};
+//-------------------------------------------------------------------------------------------------
+template<class Index, class Body>
+class ParallelForLoop : public ParallelLoop<ParallelForLoop<Index, Body>>
+{
+public:
+	ParallelForLoop(TaskProcessor& pool, const ParallelChunks<Index>& chunks, Body& body):
+		ParallelLoop<ParallelForLoop>(pool),
+		m_Chunks(chunks),
+		m_Body(body)
+	{
+	}
+
+	void RunChunk(std::size_t chunk)
+	{
+		if (this->Failed())
+			return;
+		try
+		{
+			m_Body(m_Chunks.Begin(chunk), m_Chunks.End(chunk));
+		}
+		catch (...)
+		{
+			this->Fail();
+		}
+	}
+
+private:
+	const ParallelChunks<Index>&	m_Chunks;
+	Body&							m_Body;
+};
+//-------------------------------------------------------------------------------------------------
+template<class Index, class T, class Body>
+class ParallelReduceLoop : public ParallelLoop<ParallelReduceLoop<Index, T, Body>>
+{
+public:
+	// a struct, not a bare T: chunks are written concurrently and vector<bool> packs bits
+	struct Partial
+	{
+		T m_Value;
+	};
+
+	ParallelReduceLoop(TaskProcessor& pool, const ParallelChunks<Index>& chunks, Body& body,
+		const T& identity, std::vector<Partial>& partials):
+		ParallelLoop<ParallelReduceLoop>(pool),
+		m_Chunks(chunks),
+		m_Body(body),
+		m_Identity(identity),
+		m_Partials(partials)
+	{
+	}
+
+	void RunChunk(std::size_t chunk)
+	{
+		if (this->Failed())
+			return;
+		try
+		{
+			m_Partials[chunk].m_Value = m_Body(m_Chunks.Begin(chunk), m_Chunks.End(chunk), m_Identity);
+		}
+		catch (...)
+		{
+			this->Fail();
+		}
+	}
+
+private:
+	const ParallelChunks<Index>&	m_Chunks;
+	Body&							m_Body;
+	const T&						m_Identity;
+	std::vector<Partial>&			m_Partials;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	ParallelFor calls body(begin, end) for consecutive sub-ranges covering [first, last).
+*/
+template<class Index, class Body>
+void ParallelFor(TaskProcessor& pool, Index first, Index last, std::size_t grain, Body&& body)
+{
+	const ParallelChunks<Index> chunks(first, last, grain, pool.ThreadCount());
+	ParallelForLoop<Index, typename std::remove_reference<Body>::type> loop(pool, chunks, body);
+	loop.Run(chunks.Count());
+}
+
+template<class Index, class Body>
+void ParallelFor(TaskProcessor& pool, Index first, Index last, Body&& body)
+{
+	ParallelFor(pool, first, last, 0, std::forward<Body>(body));
+}
+//-------------------------------------------------------------------------------------------------
+/*
+	ParallelReduce computes body(begin, end, identity) for every chunk and folds the results
+	with combine, left to right in chunk order, so combine only has to be associative. The
+	result does not depend on how the chunks were scheduled, only on the grain.
+*/
+template<class Index, class T, class Body, class Combine>
+T ParallelReduce(TaskProcessor& pool, Index first, Index last, std::size_t grain, const T& identity,
+	Body&& body, Combine&& combine)
+{
+	typedef ParallelReduceLoop<Index, T, typename std::remove_reference<Body>::type> Loop;
+
+	const ParallelChunks<Index> chunks(first, last, grain, pool.ThreadCount());
+	std::vector<typename Loop::Partial> partials(chunks.Count(), typename Loop::Partial{identity});
+
+	Loop loop(pool, chunks, body, identity, partials);
+	loop.Run(chunks.Count());
+
+	T result = identity;
+	for (typename Loop::Partial& partial : partials)
+		result = combine(std::move(result), std::move(partial.m_Value));
+	return result;
+}
+
+template<class Index, class T, class Body, class Combine>
+T ParallelReduce(TaskProcessor& pool, Index first, Index last, const T& identity, Body&& body, Combine&& combine)
+{
+	return ParallelReduce(pool, first, last, 0, identity, std::forward<Body>(body), std::forward<Combine>(combine));
+}
+//-------------------------------------------------------------------------------------------------
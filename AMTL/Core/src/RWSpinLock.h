@@ -0,0 +1,164 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "CpuRelax.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	RWSpinLock is a "big reader" lock: readers never write to a shared cache line.
+
+	Every reader slot counts the readers in it and sits on its own cache line. A thread picks its
+	slot once, from the core it first runs on, so readers on different cores do not contend at
+	all. A writer raises m_Writer and then waits for every slot to drain, which makes writing
+	cost O(READER_SLOTS) and is the right trade only for data that is read far more often than
+	written. Waiting readers step back while a writer is pending, so writers cannot starve.
+
+	Readers and writers both spin; the lock is not reentrant.
+*/
+class RWSpinLock
+{
+public:
+	constexpr static std::size_t READER_SLOTS = 32;
+
+	RWSpinLock() : m_Writer(false)
+	{
+		for (std::size_t i = 0; i != READER_SLOTS; ++i)
+			m_Readers[i].m_Count.store(0, std::memory_order_relaxed);
+	}
+
+	RWSpinLock(const RWSpinLock&) = delete;
+	RWSpinLock& operator=(const RWSpinLock&) = delete;
+
+	void lock()
+	{
+		SpinWait wait;
+		while (m_Writer.load(std::memory_order_relaxed) || m_Writer.exchange(true, std::memory_order_seq_cst))
+			wait.Once();
+
+		// seq_cst like the reader side: an acquire load could still read a count the reader
+		// has already raised as 0 while that reader sees no flag, and both would get in
+		for (std::size_t i = 0; i != READER_SLOTS; ++i)
+		{
+			while (m_Readers[i].m_Count.load(std::memory_order_seq_cst) != 0)
+				wait.Once();
+		}
+	}
+
+	void unlock()
+	{
+		m_Writer.store(false, std::memory_order_release);
+	}
+
+	bool tryLock()
+	{
+		if (m_Writer.load(std::memory_order_relaxed) || m_Writer.exchange(true, std::memory_order_seq_cst))
+			return false;
+
+		for (std::size_t i = 0; i != READER_SLOTS; ++i)
+		{
+			if (m_Readers[i].m_Count.load(std::memory_order_seq_cst) != 0)
+			{
+				unlock();
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void lock_shared()
+	{
+		std::atomic<int>& count = m_Readers[ReaderSlot()].m_Count;
+		SpinWait wait;
+		for (;;)
+		{
+			// seq_cst on both sides, the writer's count loads included: either the writer sees our
+			// count or we see its flag
+			count.fetch_add(1, std::memory_order_seq_cst);
+			if (!m_Writer.load(std::memory_order_seq_cst))
+				return;
+
+			count.fetch_sub(1, std::memory_order_relaxed);
+			while (m_Writer.load(std::memory_order_relaxed))
+				wait.Once();
+		}
+	}
+
+	void unlock_shared()
+	{
+		m_Readers[ReaderSlot()].m_Count.fetch_sub(1, std::memory_order_release);
+	}
+
+	bool tryLockShared()
+	{
+		if (m_Writer.load(std::memory_order_relaxed))
+			return false;
+
+		std::atomic<int>& count = m_Readers[ReaderSlot()].m_Count;
+		count.fetch_add(1, std::memory_order_seq_cst);
+		if (!m_Writer.load(std::memory_order_seq_cst))
+			return true;
+
+		count.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+
+private:
+	constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+	struct alignas(CACHE_LINE_SIZE) ReaderCount
+	{
+		std::atomic<int> m_Count;
+	};
+
+	// fixed per thread, so lock_shared and unlock_shared always agree even if the thread migrates
+	static std::size_t ReaderSlot()
+	{
+		static thread_local std::size_t slot = PickSlot();
+		return slot;
+	}
+
+	static std::size_t PickSlot()
+	{
+#if defined(__linux__)
+		const int cpu = sched_getcpu();
+		if (cpu >= 0)
+			return static_cast<std::size_t>(cpu) % READER_SLOTS;
+#endif
+		return std::hash<std::thread::id>()(std::this_thread::get_id()) % READER_SLOTS;
+	}
+
+	alignas(CACHE_LINE_SIZE) std::atomic<bool>	m_Writer;
+	ReaderCount									m_Readers[READER_SLOTS];
+};
+//-------------------------------------------------------------------------------------------------
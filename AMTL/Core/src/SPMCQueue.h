@@ -0,0 +1,255 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+#include "BoundedMPMCQueue.h"
+#include "WaitableQueue.h"
+
+namespace amtl
+{
+
+    /*
+        SPMCQueue is a single-producer,multi-consumer queue with the same interface as MPMCQueue.
+
+        It is MPMCQueue with the push side taken out of the reference counting: the only thread that touches
+        tail is the producer, so tail is a plain pointer and push() is a placement new plus one release store
+        linking a fresh dummy node. Consumers still race for head, and head keeps the split reference count of
+        MPMCQueue (an external count next to the pointer, an internal count in the node) so a node is only
+        reused once every consumer that read head has let go of it. Since head is the only counted pointer, the
+        node's internal count needs no separate "external counters" bits.
+
+        The behavior is undefined if more than one thread pushes concurrently.
+    */
+    template<class T>
+    class SPMCQueue : public detail::waitable_queue<SPMCQueue<T>,T>
+    {
+        private:
+
+            static_assert(std::is_nothrow_move_constructible<T>::value,"SPMCQueue requires a nothrow move constructible T");
+
+            constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+            struct node
+            {
+                std::atomic<int> internal_count;
+                std::atomic<node*> next;                // set by the producer once this node's value is in place
+                typename std::aligned_storage<sizeof(T),alignof(T)>::type storage;
+
+                node()
+                {
+                    reset();
+                }
+
+                // a recycled node is only reset once its count reached 0, so no other thread can see it
+                void reset() noexcept
+                {
+                    internal_count.store(0,std::memory_order_relaxed);
+                    next.store(nullptr,std::memory_order_relaxed);
+                }
+
+                T* value() noexcept { return reinterpret_cast<T*>(&storage); }
+            };
+
+            // external_count is pointer sized so the struct has no padding, see MPMCQueue
+            struct counted_node_pointer
+            {
+                std::intptr_t external_count;
+                node* node_ptr;
+            };
+
+            alignas(CACHE_LINE_SIZE) std::atomic<counted_node_pointer> head;  // consumers
+            alignas(CACHE_LINE_SIZE) node* tail;                              // producer, always an empty dummy
+
+            // retired nodes waiting to be reused by push(); null when node caching is disabled
+            std::unique_ptr<BoundedMPMCQueue<node*>> free_nodes;
+
+            static std::unique_ptr<BoundedMPMCQueue<node*>> make_free_list(std::size_t max_cached_nodes)
+            {
+                if(max_cached_nodes == 0)
+                {
+                    return {};
+                }
+
+                std::size_t capacity = 2;
+                while(capacity < max_cached_nodes)
+                {
+                    capacity <<= 1;
+                }
+                return std::unique_ptr<BoundedMPMCQueue<node*>>{new BoundedMPMCQueue<node*>(capacity)};
+            }
+
+            node* acquire_node()
+            {
+                node* recycled;
+                if(free_nodes && free_nodes->try_pop(recycled))
+                {
+                    recycled->reset();
+                    return recycled;
+                }
+                return new node;
+            }
+
+            void retire_node(node* node_ptr) noexcept
+            {
+                if(!free_nodes || !free_nodes->try_push(node_ptr))
+                {
+                    delete node_ptr;
+                }
+            }
+
+            void increase_ref_count(counted_node_pointer& old_node) noexcept
+            {
+                counted_node_pointer new_node;
+                do
+                {
+                    new_node = old_node;
+                    ++new_node.external_count;
+                } while(! head.compare_exchange_strong(old_node,new_node));
+
+                old_node.external_count = new_node.external_count;
+            }
+
+            void release_reference(node* node_ptr) noexcept
+            {
+                if(node_ptr->internal_count.fetch_sub(1) == 1)
+                {
+                    retire_node(node_ptr);
+                }
+            }
+
+            // the consumer that moved head off the node folds head's external count into the internal one;
+            // -2 for head's own reference and for the winner's
+            void free_external_count(counted_node_pointer& winner) noexcept
+            {
+                const int num_increase = static_cast<int>(winner.external_count - 2);
+                if(winner.node_ptr->internal_count.fetch_add(num_increase) == -num_increase)
+                {
+                    retire_node(winner.node_ptr);
+                }
+            }
+
+            // pop_impl detaches the head node and hands its value to extract before the node is released.
+            // Returns false if the queue was empty.
+            template<class Extract>
+            bool pop_impl(Extract&& extract)
+            {
+                counted_node_pointer old_head = head.load();
+                for(;;)
+                {
+                    increase_ref_count(old_head);
+                    node* const ptr = old_head.node_ptr;
+                    node* const next = ptr->next.load(std::memory_order_acquire);
+
+                    if(! next)
+                    {
+                        // ptr is the producer's dummy: empty queue
+                        release_reference(ptr);
+                        return false;
+                    }
+
+                    if(head.compare_exchange_strong(old_head,counted_node_pointer{1,next}))
+                    {
+                        // the node goes back even if extract throws, the value is gone either way
+                        struct release_on_exit
+                        {
+                            SPMCQueue* queue;
+                            counted_node_pointer& winner;
+                            ~release_on_exit() { winner.node_ptr->value()->~T(); queue->free_external_count(winner); }
+                        } guard{this,old_head};
+
+                        extract(ptr->value());
+                        return true;
+                    }
+
+                    release_reference(ptr);
+                }
+            }
+
+        public:
+            // max_cached_nodes caps how many retired nodes the queue keeps around for reuse, 0 disables caching.
+            explicit SPMCQueue(std::size_t max_cached_nodes = 1024) :
+                free_nodes(make_free_list(max_cached_nodes))
+            {
+                tail = new node;
+                head.store(counted_node_pointer{1,tail});
+            }
+
+            ~SPMCQueue()
+            {
+                node* current = head.load().node_ptr;
+                while(current != tail)
+                {
+                    node* const next = current->next.load(std::memory_order_relaxed);
+                    current->value()->~T();
+                    delete current;
+                    current = next;
+                }
+                delete tail;
+
+                node* recycled;
+                while(free_nodes && free_nodes->try_pop(recycled))
+                {
+                    delete recycled;
+                }
+            }
+
+            // push constructs a T from the arguments and appends it. Producer thread only.
+
+            // push provides the strong exception safety guarantee
+            template<typename... CtorArgs>
+            void push(CtorArgs&&... ctor_args)
+            {
+                T value{std::forward<CtorArgs>(ctor_args)...};
+                node* const dummy = acquire_node();
+
+                node* const filled = tail;
+                new (filled->value()) T(std::move(value));
+                tail = dummy;
+                filled->next.store(dummy,std::memory_order_release);
+
+                // seq_cst so a consumer about to park either sees the item or is seen by the notify
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                this->not_empty.NotifyOne();
+            }
+
+            template<typename InputIt>
+            void push_bulk(InputIt first, InputIt last)
+            {
+                for(; first != last; ++first)
+                {
+                    push(*first);
+                }
+            }
+
+            // try_pop moves the front item into out and returns true, or returns false if the queue is empty.
+            bool try_pop(T& out) noexcept(std::is_nothrow_move_assignable<T>::value)
+            {
+                return pop_impl([&](T* value){ out = std::move(*value); });
+            }
+
+            // pop returns the front item, or an empty unique_ptr if the queue is empty.
+            std::unique_ptr<T> pop()
+            {
+                std::unique_ptr<T> data;
+                pop_impl([&](T* value){ data.reset(new T(std::move(*value))); });
+                return data;
+            }
+
+            // pop_bulk pops up to max items into out, one node at a time, and returns how many it took.
+            template<typename OutputIt>
+            std::size_t pop_bulk(OutputIt out, std::size_t max)
+            {
+                std::size_t count = 0;
+                while(count != max && pop_impl([&](T* value){ *out = std::move(*value); ++out; }))
+                {
+                    ++count;
+                }
+                return count;
+            }
+    };
+}
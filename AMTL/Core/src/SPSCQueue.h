@@ -0,0 +1,214 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+#include "WaitableQueue.h"
+
+namespace amtl
+{
+
+    /*
+        SPSCQueue is a wait-free single-producer,single-consumer queue with the same interface as MPMCQueue.
+
+        With exactly one thread on each side no CAS is needed at all: the producer owns the write index and the
+        consumer owns the read index, and each side only publishes its progress with a release store. Elements are
+        stored inline in fixed-size blocks of BLOCK_SIZE cells. When the producer fills a block it links a new one;
+        when the consumer drains a block it hands it back through a one-element spare slot, so a queue whose depth
+        oscillates below a block or two cycles through the same blocks without allocating.
+
+        The behavior is undefined if more than one thread pushes, or more than one thread pops, concurrently.
+    */
+    template<class T, std::size_t BLOCK_SIZE = 256>
+    class SPSCQueue : public detail::waitable_queue<SPSCQueue<T,BLOCK_SIZE>,T>
+    {
+        private:
+
+            static_assert(std::is_nothrow_move_constructible<T>::value,"SPSCQueue requires a nothrow move constructible T");
+
+            constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+            struct block
+            {
+                std::atomic<std::size_t> written;       // cells [0,written) hold published items; producer stores, consumer loads
+                std::atomic<block*> next;               // linked by the producer once this block is full
+                typename std::aligned_storage<sizeof(T),alignof(T)>::type cells[BLOCK_SIZE];
+
+                block() : written(0), next(nullptr) {}
+
+                T* cell(std::size_t i) noexcept { return reinterpret_cast<T*>(&cells[i]); }
+            };
+
+            // producer side
+            alignas(CACHE_LINE_SIZE) block* tail_block;
+
+            // consumer side
+            alignas(CACHE_LINE_SIZE) block* head_block;
+            std::size_t head_index;
+
+            // a drained block on its way back from the consumer to the producer
+            alignas(CACHE_LINE_SIZE) std::atomic<block*> spare;
+
+            block* acquire_block()
+            {
+                block* recycled = spare.exchange(nullptr,std::memory_order_acquire);
+                if(recycled)
+                {
+                    recycled->written.store(0,std::memory_order_relaxed);
+                    recycled->next.store(nullptr,std::memory_order_relaxed);
+                    return recycled;
+                }
+                return new block;
+            }
+
+            void retire_block(block* drained) noexcept
+            {
+                delete spare.exchange(drained,std::memory_order_acq_rel);
+            }
+
+            // consumer only: the cell holding the next item, or nullptr if there is none yet
+            T* front() noexcept
+            {
+                for(;;)
+                {
+                    if(head_index < head_block->written.load(std::memory_order_acquire))
+                    {
+                        return head_block->cell(head_index);
+                    }
+
+                    if(head_index != BLOCK_SIZE)
+                    {
+                        return nullptr;
+                    }
+
+                    block* next = head_block->next.load(std::memory_order_acquire);
+                    if(! next)
+                    {
+                        return nullptr;
+                    }
+
+                    retire_block(head_block);
+                    head_block = next;
+                    head_index = 0;
+                }
+            }
+
+        public:
+            SPSCQueue() :
+                tail_block(new block),
+                head_block(tail_block),
+                head_index(0),
+                spare(nullptr)
+            {
+            }
+
+            ~SPSCQueue()
+            {
+                while(T* value = front())
+                {
+                    value->~T();
+                    ++head_index;
+                }
+
+                // front() stops at the last block, which is the producer's
+                delete head_block;
+                delete spare.load();
+            }
+
+            // push constructs a T from the arguments and appends it. Producer thread only.
+
+            // push provides the strong exception safety guarantee
+            template<typename... CtorArgs>
+            void push(CtorArgs&&... ctor_args)
+            {
+                T value{std::forward<CtorArgs>(ctor_args)...};
+
+                block* target = tail_block;
+                const std::size_t index = target->written.load(std::memory_order_relaxed);
+                if(index != BLOCK_SIZE)
+                {
+                    new (target->cell(index)) T(std::move(value));
+                    target->written.store(index + 1,std::memory_order_release);
+                }
+                else
+                {
+                    block* next = acquire_block();
+                    new (next->cell(0)) T(std::move(value));
+                    next->written.store(1,std::memory_order_relaxed);
+                    target->next.store(next,std::memory_order_release);
+                    tail_block = next;
+                }
+
+                // seq_cst so a consumer about to park either sees the item or is seen by the notify
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                this->not_empty.NotifyOne();
+            }
+
+            template<typename InputIt>
+            void push_bulk(InputIt first, InputIt last)
+            {
+                for(; first != last; ++first)
+                {
+                    push(*first);
+                }
+            }
+
+            // try_pop moves the front item into out and returns true, or returns false if the queue is empty.
+            // Consumer thread only.
+            bool try_pop(T& out) noexcept(std::is_nothrow_move_assignable<T>::value)
+            {
+                T* value = front();
+                if(! value)
+                {
+                    return false;
+                }
+
+                struct destroy_on_exit
+                {
+                    T* value;
+                    std::size_t& index;
+                    ~destroy_on_exit() { value->~T(); ++index; }
+                } guard{value,head_index};
+
+                out = std::move(*value);
+                return true;
+            }
+
+            // pop returns the front item, or an empty unique_ptr if the queue is empty. Consumer thread only.
+            std::unique_ptr<T> pop()
+            {
+                T* value = front();
+                if(! value)
+                {
+                    return {};
+                }
+
+                std::unique_ptr<T> data{ new T(std::move(*value)) };
+                value->~T();
+                ++head_index;
+                return data;
+            }
+
+            template<typename OutputIt>
+            std::size_t pop_bulk(OutputIt out, std::size_t max)
+            {
+                std::size_t count = 0;
+                for(T* value; count != max && (value = front()) != nullptr; ++count)
+                {
+                    struct destroy_on_exit
+                    {
+                        T* value;
+                        std::size_t& index;
+                        ~destroy_on_exit() { value->~T(); ++index; }
+                    } guard{value,head_index};
+
+                    *out = std::move(*value);
+                    ++out;
+                }
+                return count;
+            }
+    };
+}
@@ -0,0 +1,115 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "CpuRelax.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	SeqLock publishes a small trivially copyable value. Readers never write shared memory: they
+	copy the value and retry if a write overlapped the copy, so any number of readers scale
+	freely and a writer never waits for them. Writers are serialized among themselves.
+
+	The value is kept as an array of relaxed atomic words, so a copy torn by a concurrent write
+	is just discarded rather than being a data race.
+*/
+template<class T>
+class SeqLock
+{
+	static_assert(std::is_trivially_copyable<T>::value, "SeqLock requires a trivially copyable T");
+
+public:
+	explicit SeqLock(const T& value = T()) : m_Sequence(0)
+	{
+		Word words[WORDS] = {};
+		std::memcpy(words, &value, sizeof(T));
+		for (std::size_t i = 0; i != WORDS; ++i)
+			m_Words[i].store(words[i], std::memory_order_relaxed);
+	}
+
+	SeqLock(const SeqLock&) = delete;
+	SeqLock& operator=(const SeqLock&) = delete;
+
+	T Load() const
+	{
+		Word words[WORDS];
+		SpinWait wait;
+		for (;;)
+		{
+			const std::uint32_t before = m_Sequence.load(std::memory_order_acquire);
+			if ((before & 1) == 0)
+			{
+				for (std::size_t i = 0; i != WORDS; ++i)
+					words[i] = m_Words[i].load(std::memory_order_relaxed);
+
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (m_Sequence.load(std::memory_order_relaxed) == before)
+					break;
+			}
+			wait.Once();
+		}
+
+		// T need not be default constructible
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+		std::memcpy(&value, words, sizeof(T));
+		return *reinterpret_cast<T*>(&value);
+	}
+
+	void Store(const T& value)
+	{
+		Word words[WORDS] = {};
+		std::memcpy(words, &value, sizeof(T));
+
+		// an odd sequence marks a write in progress and doubles as the writers' lock. Taking it
+		// acquires the previous writer's release, so our word stores land after its ones
+		std::uint32_t sequence = m_Sequence.load(std::memory_order_relaxed);
+		SpinWait wait;
+		while ((sequence & 1) != 0 ||
+			!m_Sequence.compare_exchange_weak(sequence, sequence + 1, std::memory_order_acquire, std::memory_order_relaxed))
+		{
+			wait.Once();
+			sequence = m_Sequence.load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_release);
+
+		for (std::size_t i = 0; i != WORDS; ++i)
+			m_Words[i].store(words[i], std::memory_order_relaxed);
+
+		m_Sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+private:
+	typedef std::uintptr_t Word;
+
+	constexpr static std::size_t WORDS = (sizeof(T) + sizeof(Word) - 1) / sizeof(Word);
+
+	std::atomic<std::uint32_t>	m_Sequence;
+	std::atomic<Word>			m_Words[WORDS];
+};
+//-------------------------------------------------------------------------------------------------
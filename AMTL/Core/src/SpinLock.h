@@ -26,41 +26,151 @@
 #pragma once
 //-------------------------------------------------------------------------------------------------
 #include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include "CpuRelax.h"
+#include "Futex.h"
+#include "LockStats.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	Backoff policies for BasicSpinlock. They decide what a waiter does once its exponential
+	CpuRelax() backoff has reached the cap:
+
+		SpinBackoff		keeps pausing, never leaves the CPU (lowest latency, for very short sections)
+		YieldBackoff	gives the rest of the time slice away with sched_yield
+		FutexBackoff	parks the thread in the kernel until the holder unlocks
+
+	PARKS tells the lock whether unlock() has to wake somebody.
+*/
+struct SpinBackoff
+{
+	constexpr static bool PARKS = false;
+
+	static void Wait(std::atomic<int>&, int) { CpuRelax(); }
+	static void Wake(std::atomic<int>&) {}
+};
+//-------------------------------------------------------------------------------------------------
+struct YieldBackoff
+{
+	constexpr static bool PARKS = false;
+
+	static void Wait(std::atomic<int>&, int) { std::this_thread::yield(); }
+	static void Wake(std::atomic<int>&) {}
+};
 //-------------------------------------------------------------------------------------------------
-class Spinlock
+struct FutexBackoff
+{
+	constexpr static bool PARKS = true;
+
+	static void Wait(std::atomic<int>& state, int expected) { FutexWait(state, expected); }
+	static void Wake(std::atomic<int>& state) { FutexWakeOne(state); }
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	BasicSpinlock is a test-and-test-and-set lock: a waiter spins on a plain load, which stays
+	in its own cache, and only attempts the compare-exchange once the lock looks free. Between
+	attempts it backs off with CpuRelax(), doubling the pause count up to MAX_BACKOFF, and after
+	that hands over to the Backoff policy.
+
+	With AMTL_LOCK_STATS defined every lock reports its contention to LockStatsRegistry.
+*/
+template<class Backoff>
+class BasicSpinlock : public LockStats
 {
 public:
-	Spinlock()		
+	// pause iterations a waiter may reach before it falls back to Backoff::Wait
+	constexpr static int MAX_BACKOFF = 256;
+
+	BasicSpinlock() : m_State(UNLOCKED) {}
+
+	BasicSpinlock(const BasicSpinlock&) = delete;
+	BasicSpinlock& operator=(const BasicSpinlock&) = delete;
+
+	void lock()
+	{
+		const std::uint64_t start = StatsClock();
+		std::uint64_t spins = 0;
+		if (!TryAcquire())
+			spins = LockSlow();
+		StatsAcquired(start, spins);
+	}
+
+	void unlock()
+	{
+		StatsReleased();
+		if (Backoff::PARKS)
+		{
+			if (m_State.exchange(UNLOCKED, std::memory_order_release) == CONTENDED)
+				Backoff::Wake(m_State);
+		}
+		else
+		{
+			m_State.store(UNLOCKED, std::memory_order_release);
+		}
+	}
+
+	bool tryLock()
 	{
-		m_locked.clear(); //VS workaround
+		const std::uint64_t start = StatsClock();
+		if (m_State.load(std::memory_order_relaxed) != UNLOCKED || !TryAcquire())
+			return false;
+
+		StatsAcquired(start, 0);
+		return true;
 	}
 
-    void lock()
-    {
-		int repeatCount = 100;
+private:
+	enum
+	{
+		UNLOCKED = 0,
+		LOCKED = 1,
+		CONTENDED = 2	// locked, and somebody may be parked (FutexBackoff only)
+	};
+
+	// UNLOCKED -> LOCKED only: an exchange would overwrite CONTENDED and strand the parked waiters
+	bool TryAcquire()
+	{
+		int expected = UNLOCKED;
+		return m_State.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed);
+	}
 
-		while (true)
+	// returns how many times the waiter paused or waited, for the statistics
+	std::uint64_t LockSlow()
+	{
+		std::uint64_t spins = 0;
+		for (int backoff = 1; backoff <= MAX_BACKOFF; backoff <<= 1)
+		{
+			for (int i = 0; i != backoff; ++i)
+				CpuRelax();
+			spins += backoff;
+
+			if (m_State.load(std::memory_order_relaxed) == UNLOCKED && TryAcquire())
+				return spins;
+		}
+
+		if (Backoff::PARKS)
 		{
-			if (m_locked.test_and_set(std::memory_order::memory_order_acquire))
-				--repeatCount;
-			else
-				break;
-			
-			if (repeatCount == 0)
+			// take the lock as CONTENDED: we cannot know whether other threads are still parked
+			while (m_State.exchange(CONTENDED, std::memory_order_acquire) != UNLOCKED)
 			{
-				//usleep(100); //ACHTUNG!!! place delay here
-				repeatCount = 100;
+				Backoff::Wait(m_State, CONTENDED);
+				++spins;
 			}
+			return spins;
+		}
+
+		for (;;)
+		{
+			Backoff::Wait(m_State, LOCKED);
+			++spins;
+			if (m_State.load(std::memory_order_relaxed) == UNLOCKED && TryAcquire())
+				return spins;
 		}
-    }
-    void unlock(){m_locked.clear(std::memory_order::memory_order_release);}
-    
-    bool tryLock()
-	{
-		return !m_locked.test_and_set(std::memory_order::memory_order_acquire);
 	}
 
-private:
-	std::atomic_flag m_locked;
+	std::atomic<int> m_State;
 };
 //-------------------------------------------------------------------------------------------------
+typedef BasicSpinlock<YieldBackoff> Spinlock;
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,114 @@
+#include "Strand.h"
+#include "CpuRelax.h"
+
+#include <thread>
+//-------------------------------------------------------------------------------------------------
+namespace
+{
+	// the strand whose task the current thread runs
+	thread_local const Strand* t_CurrentStrand = nullptr;
+}
+//-------------------------------------------------------------------------------------------------
+class Strand::DrainTask
+{
+public:
+	explicit DrainTask(Strand* strand) : m_Strand(strand) {}
+
+	void operator()() { m_Strand->Drain(); }
+	void OnDrop() { m_Strand->DropQueued(); }
+
+private:
+	Strand* m_Strand;
+};
+//-------------------------------------------------------------------------------------------------
+Strand::Strand(TaskProcessor& pool):
+	m_Pool(pool),
+	m_Count(0)
+{
+}
+//-------------------------------------------------------------------------------------------------
+Strand::~Strand()
+{
+	while (m_Count.load(std::memory_order_acquire) != 0)
+	{
+		if (!m_Pool.RunPendingTask())
+			std::this_thread::yield();
+	}
+}
+//-------------------------------------------------------------------------------------------------
+bool Strand::RunningInThisThread() const
+{
+	return t_CurrentStrand == this;
+}
+//-------------------------------------------------------------------------------------------------
+void Strand::Enqueue(TaskSlot* task)
+{
+	// the push is complete before it is counted, so the drain never waits for a counted task
+	// that has not been pushed yet
+	m_Queue.push(task);
+	if (m_Count.fetch_add(1, std::memory_order_acq_rel) == 0 && !Schedule())
+		Drain();
+}
+//-------------------------------------------------------------------------------------------------
+// false if the pool had no slot for the drain; the count is ours then, so the caller drains
+bool Strand::Schedule()
+{
+	try
+	{
+		m_Pool.Post(DrainTask(this));
+		return true;
+	}
+	catch (...)
+	{
+		return false;
+	}
+}
+//-------------------------------------------------------------------------------------------------
+void Strand::Drain() noexcept
+{
+	const Strand* outer = t_CurrentStrand;
+	t_CurrentStrand = this;
+
+	for (unsigned ran = 1; ; ++ran)
+	{
+		// pop may come up empty while another producer is between its two pushing
+		// instructions; the counted task is right behind it
+		TaskSlot* task = m_Queue.pop();
+		for (SpinWait wait; !task; task = m_Queue.pop())
+			wait.Once();
+
+		task->m_Func();
+		TaskSlotPool::Free(task);
+
+		// back to zero: nothing left and nobody scheduled, *this may be gone from here on
+		if (m_Count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			break;
+
+		if (ran == MAX_BATCH)
+		{
+			if (Schedule())
+				break;
+			ran = 0;
+		}
+	}
+
+	t_CurrentStrand = outer;
+}
+//-------------------------------------------------------------------------------------------------
+// a drain dropped at shutdown: the queued tasks go with it, until the count is back to zero
+void Strand::DropQueued()
+{
+	for (;;)
+	{
+		TaskSlot* task = m_Queue.pop();
+		for (SpinWait wait; !task; task = m_Queue.pop())
+			wait.Once();
+
+		task->m_Func.Drop();
+		TaskSlotPool::Free(task);
+
+		if (m_Count.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			break;
+	}
+}
+//-------------------------------------------------------------------------------------------------
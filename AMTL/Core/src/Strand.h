@@ -0,0 +1,119 @@
+//
+// Strands
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <future>
+#include <utility>
+
+#include "MPSCQueue.h"
+#include "Task.h"
+#include "TaskProcessor.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	Strand runs the tasks posted to it one at a time, in the order they were posted, on the
+	workers of a TaskProcessor. It replaces a mutex taken inside every task: instead of workers
+	blocking on each other, a strand occupies at most one worker and only while it has work.
+
+	Posting pushes onto a lock-free IntrusiveMPSCQueue and bumps m_Count. The poster that takes
+	the count from zero schedules a drain on the pool, so a non-zero count is the "scheduled"
+	flag. The drain runs tasks until its decrement takes the count back to zero. After MAX_BATCH
+	tasks it re-posts itself, so a busy strand leaves room for other work. If the pool has no
+	slot for the drain, the thread that tried to schedule it runs it instead.
+
+	Tasks are held in TaskSlots from the pool's TaskSlotPool, so posting does not allocate in
+	the steady state either. A drain dropped by a pool shutdown drops the queued tasks with it.
+
+	The destructor waits (helping the pool) until every posted task has run.
+*/
+class Strand
+{
+public:
+	constexpr static unsigned MAX_BATCH = 64;
+
+	explicit Strand(TaskProcessor& pool);
+	~Strand();
+
+	Strand(const Strand&) = delete;
+	Strand& operator=(const Strand&) = delete;
+
+	TaskProcessor& Pool() const { return m_Pool; }
+
+	// true while the calling thread runs one of this strand's tasks
+	bool RunningInThisThread() const;
+
+	/*
+		Post queues t(args...) behind everything posted to the strand before. An exception
+		escaping the task terminates the process.
+	*/
+	template<class T, class... Args>
+	void Post(T&& t, Args&&... args)
+	{
+		Enqueue(MakeTask(BindTask(std::forward<T>(t), std::forward<Args>(args)...)));
+	}
+
+	// as Post, with a future for the result
+	template<class T, class... Args>
+	auto Add(T&& t, Args&&... args)
+		-> std::future<typename std::result_of<T(Args...)>::type>
+	{
+		using return_type = typename std::result_of<T(Args...)>::type;
+
+		std::packaged_task<return_type()> task(BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+		auto res = task.get_future();
+
+		Enqueue(MakeTask(std::move(task)));
+		return res;
+	}
+
+private:
+	template<class F>
+	static TaskSlot* MakeTask(F&& f)
+	{
+		TaskSlot* slot = TaskSlotPool::Allocate();
+		try
+		{
+			slot->m_Func.Assign(std::forward<F>(f));
+		}
+		catch (...)
+		{
+			TaskSlotPool::Free(slot);
+			throw;
+		}
+		return slot;
+	}
+
+	class DrainTask;
+
+	void Enqueue(TaskSlot* task);
+	bool Schedule();
+	void Drain() noexcept;	// a task exception terminates, even when the drain runs inline on a poster
+	void DropQueued();
+
+	TaskProcessor&							m_Pool;
+	amtl::IntrusiveMPSCQueue<TaskSlot>		m_Queue;
+	std::atomic<std::size_t>				m_Count;	// posted and not yet run, non-zero while scheduled
+};
+//-------------------------------------------------------------------------------------------------
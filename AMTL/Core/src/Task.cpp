@@ -0,0 +1,99 @@
+#include "Task.h"
+#include "SpinLock.h"
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#define SLOT_BATCH_SIZE 64
+#define SLOT_CACHE_SIZE (4 * SLOT_BATCH_SIZE)
+//-------------------------------------------------------------------------------------------------
+namespace
+{
+	struct SharedSlots
+	{
+		SharedSlots()
+		{
+			SetLockName(m_Lock, "TaskSlotPool");
+		}
+
+		Spinlock				m_Lock;
+		std::vector<TaskSlot*>	m_Free;
+	};
+
+	// intentionally never destroyed: thread caches may be flushed into it during static destruction
+	SharedSlots& GetSharedSlots()
+	{
+		static SharedSlots* shared = new SharedSlots;
+		return *shared;
+	}
+
+	struct SlotCache
+	{
+		SlotCache()
+		{
+			m_Slots.reserve(SLOT_CACHE_SIZE + SLOT_BATCH_SIZE);
+		}
+
+		~SlotCache()
+		{
+			SharedSlots& shared = GetSharedSlots();
+			std::lock_guard<Spinlock> lock(shared.m_Lock);
+			shared.m_Free.insert(shared.m_Free.end(), m_Slots.begin(), m_Slots.end());
+		}
+
+		void Refill()
+		{
+			SharedSlots& shared = GetSharedSlots();
+			{
+				std::lock_guard<Spinlock> lock(shared.m_Lock);
+				std::size_t count = std::min<std::size_t>(shared.m_Free.size(), SLOT_BATCH_SIZE);
+				m_Slots.insert(m_Slots.end(), shared.m_Free.end() - count, shared.m_Free.end());
+				shared.m_Free.resize(shared.m_Free.size() - count);
+			}
+
+			if (m_Slots.empty())
+			{
+				// slots are never returned to the system, so the block can be carved up freely
+				TaskSlot* block = new TaskSlot[SLOT_BATCH_SIZE];
+				for (int i = 0; i < SLOT_BATCH_SIZE; ++i)
+					m_Slots.push_back(block + i);
+			}
+		}
+
+		void Flush()
+		{
+			SharedSlots& shared = GetSharedSlots();
+			std::lock_guard<Spinlock> lock(shared.m_Lock);
+			shared.m_Free.insert(shared.m_Free.end(), m_Slots.end() - SLOT_BATCH_SIZE, m_Slots.end());
+			m_Slots.resize(m_Slots.size() - SLOT_BATCH_SIZE);
+		}
+
+		std::vector<TaskSlot*> m_Slots;
+	};
+
+	thread_local SlotCache t_SlotCache;
+}
+//-------------------------------------------------------------------------------------------------
+TaskSlot* TaskSlotPool::Allocate()
+{
+	SlotCache& cache = t_SlotCache;
+	if (cache.m_Slots.empty())
+		cache.Refill();
+
+	TaskSlot* slot = cache.m_Slots.back();
+	cache.m_Slots.pop_back();
+	return slot;
+}
+//-------------------------------------------------------------------------------------------------
+void TaskSlotPool::Free(TaskSlot* slot)
+{
+	slot->m_Func.Reset();
+	slot->SetNext(nullptr);
+
+	SlotCache& cache = t_SlotCache;
+	cache.m_Slots.push_back(slot);
+	if (cache.m_Slots.size() > SLOT_CACHE_SIZE)
+		cache.Flush();
+}
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,332 @@
+//
+// Task storage
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+
+#include "MPSCQueue.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskFunction is a move-only replacement for std::function<void()>.
+	Callables up to INLINE_SIZE bytes with a noexcept move constructor live inside the object,
+	anything bigger falls back to a single heap allocation.
+
+	A callable may have an OnDrop() member. Drop calls it for a task that is thrown away
+	without running (a pool shut down with DrainPolicy::Drop), so it can release whoever
+	waits for it.
+*/
+class TaskFunction
+{
+public:
+	constexpr static std::size_t INLINE_SIZE = 40;
+
+	TaskFunction() noexcept : m_Ops(nullptr) {}
+
+	template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, TaskFunction>::value>::type>
+	TaskFunction(F&& f):
+		m_Ops(nullptr)
+	{
+		Assign(std::forward<F>(f));
+	}
+
+	TaskFunction(TaskFunction&& other) noexcept:
+		m_Ops(nullptr)
+	{
+		*this = std::move(other);
+	}
+
+	TaskFunction& operator=(TaskFunction&& other) noexcept
+	{
+		if (this != &other)
+		{
+			Reset();
+			if (other.m_Ops)
+			{
+				other.m_Ops->Move(other.m_Storage, m_Storage);
+				m_Ops = other.m_Ops;
+				other.m_Ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	TaskFunction(const TaskFunction&) = delete;
+	TaskFunction& operator=(const TaskFunction&) = delete;
+
+	~TaskFunction() { Reset(); }
+
+	// provides the strong exception safety guarantee: the new callable is built before the
+	// old one goes, in place when there is no old one
+	template<class F>
+	void Assign(F&& f)
+	{
+		typedef typename std::decay<F>::type Functor;
+		typedef typename std::conditional<IsInline<Functor>::value, InlineOps<Functor>, HeapOps<Functor>>::type Ops;
+
+		if (m_Ops)
+		{
+			TaskFunction replacement;
+			Ops::Create(replacement.m_Storage, std::forward<F>(f));
+			replacement.m_Ops = &Ops::s_Table;
+			*this = std::move(replacement);
+			return;
+		}
+
+		Ops::Create(m_Storage, std::forward<F>(f));
+		m_Ops = &Ops::s_Table;
+	}
+
+	void Reset() noexcept
+	{
+		if (m_Ops)
+		{
+			m_Ops->Destroy(m_Storage);
+			m_Ops = nullptr;
+		}
+	}
+
+	void operator()() { m_Ops->Invoke(m_Storage); }
+
+	// for a task that will never run: calls the callable's OnDrop(), if it has one, then resets
+	void Drop() noexcept
+	{
+		if (m_Ops)
+		{
+			m_Ops->Drop(m_Storage);
+			Reset();
+		}
+	}
+
+	explicit operator bool() const noexcept { return m_Ops != nullptr; }
+
+private:
+	struct OpsTable
+	{
+		void (*Invoke)(void* storage);
+		void (*Move)(void* from, void* to);
+		void (*Destroy)(void* storage);
+		void (*Drop)(void* storage);
+	};
+
+	template<class F, class = void>
+	struct HasOnDrop : std::false_type
+	{
+	};
+
+	template<class F>
+	struct HasOnDrop<F, decltype(void(std::declval<F&>().OnDrop()))> : std::true_type
+	{
+	};
+
+	template<class F>
+	static void CallOnDrop(F& f, std::true_type) { f.OnDrop(); }
+
+	template<class F>
+	static void CallOnDrop(F&, std::false_type) {}
+
+	template<class F>
+	struct IsInline : std::integral_constant<bool,
+		sizeof(F) <= INLINE_SIZE &&
+		alignof(std::max_align_t) % alignof(F) == 0 &&
+		std::is_nothrow_move_constructible<F>::value>
+	{
+	};
+
+	template<class F>
+	struct InlineOps
+	{
+		template<class U>
+		static void Create(void* storage, U&& f) { new (storage) F(std::forward<U>(f)); }
+
+		static void Invoke(void* storage) { (*static_cast<F*>(storage))(); }
+
+		static void Move(void* from, void* to) noexcept
+		{
+			new (to) F(std::move(*static_cast<F*>(from)));
+			static_cast<F*>(from)->~F();
+		}
+
+		static void Destroy(void* storage) noexcept { static_cast<F*>(storage)->~F(); }
+
+		static void Drop(void* storage) { CallOnDrop(*static_cast<F*>(storage), HasOnDrop<F>()); }
+
+		static const OpsTable s_Table;
+	};
+
+	template<class F>
+	struct HeapOps
+	{
+		template<class U>
+		static void Create(void* storage, U&& f) { *static_cast<F**>(storage) = new F(std::forward<U>(f)); }
+
+		static void Invoke(void* storage) { (**static_cast<F**>(storage))(); }
+
+		static void Move(void* from, void* to) noexcept
+		{
+			*static_cast<F**>(to) = *static_cast<F**>(from);
+		}
+
+		static void Destroy(void* storage) noexcept { delete *static_cast<F**>(storage); }
+
+		static void Drop(void* storage) { CallOnDrop(**static_cast<F**>(storage), HasOnDrop<F>()); }
+
+		static const OpsTable s_Table;
+	};
+
+	alignas(std::max_align_t) unsigned char m_Storage[INLINE_SIZE];
+	const OpsTable* m_Ops;
+};
+//-------------------------------------------------------------------------------------------------
+template<class F>
+const TaskFunction::OpsTable TaskFunction::InlineOps<F>::s_Table = { &Invoke, &Move, &Destroy, &Drop };
+
+template<class F>
+const TaskFunction::OpsTable TaskFunction::HeapOps<F>::s_Table = { &Invoke, &Move, &Destroy, &Drop };
+//-------------------------------------------------------------------------------------------------
+/*
+	BoundTask stores a callable together with its arguments and invokes it exactly once,
+	passing the arguments as rvalues. It replaces std::bind on the submission path, so that
+	the common "function plus a couple of scalars" case stays small enough to be stored inline.
+*/
+template<class F, class... Args>
+class BoundTask
+{
+public:
+	template<class G, class... A>
+	explicit BoundTask(G&& f, A&&... args):
+		m_Bound(std::forward<G>(f), std::forward<A>(args)...)
+	{
+	}
+
+	auto operator()()
+		-> decltype(std::declval<F&>()(std::declval<Args>()...))
+	{
+		return Call(std::index_sequence_for<Args...>());
+	}
+
+private:
+	template<std::size_t... I>
+	auto Call(std::index_sequence<I...>)
+		-> decltype(std::declval<F&>()(std::declval<Args>()...))
+	{
+		return std::get<0>(m_Bound)(std::move(std::get<I + 1>(m_Bound))...);
+	}
+
+	std::tuple<F, Args...> m_Bound;
+};
+//-------------------------------------------------------------------------------------------------
+template<class F>
+typename std::decay<F>::type BindTask(F&& f)
+{
+	return std::forward<F>(f);
+}
+
+template<class F, class Arg, class... Args>
+BoundTask<typename std::decay<F>::type, typename std::decay<Arg>::type, typename std::decay<Args>::type...>
+	BindTask(F&& f, Arg&& arg, Args&&... args)
+{
+	return BoundTask<typename std::decay<F>::type, typename std::decay<Arg>::type, typename std::decay<Args>::type...>
+		(std::forward<F>(f), std::forward<Arg>(arg), std::forward<Args>(args)...);
+}
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskSlot is the unit the pool queues and the workers run: one cache line holding the
+	task itself plus an intrusive link, so queueing never allocates. The link is shared by
+	TaskList and a Strand's IntrusiveMPSCQueue; a slot is on one of them at a time.
+*/
+struct alignas(64) TaskSlot : amtl::mpsc_hook
+{
+	std::uint64_t	m_Queued = 0;	// enqueue time for the wait time statistics; fills the gap
+									// between the link and the 16-byte aligned m_Func
+	TaskFunction	m_Func;
+
+	// the TaskList link; lists are only touched under their owner's lock
+	TaskSlot* Next() const { return static_cast<TaskSlot*>(mpsc_next.load(std::memory_order_relaxed)); }
+	void SetNext(TaskSlot* next) { mpsc_next.store(next, std::memory_order_relaxed); }
+};
+
+static_assert(sizeof(TaskSlot) == 64, "TaskSlot must stay one cache line");
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskSlotPool recycles TaskSlots. Every thread keeps a private cache and only goes to the
+	shared free list, in batches, when its cache runs dry or overflows. Slots are allocated by
+	the submitting thread and released by the worker that ran them, so in the steady state
+	whole batches just circulate between the caches.
+*/
+class TaskSlotPool
+{
+public:
+	static TaskSlot* Allocate();
+	static void Free(TaskSlot* slot);
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskList is an intrusive FIFO of TaskSlots. It does no locking of its own.
+*/
+class TaskList
+{
+public:
+	TaskList() : m_Head(nullptr), m_Tail(nullptr), m_Size(0) {}
+
+	bool Empty() const { return m_Head == nullptr; }
+	std::size_t Size() const { return m_Size; }
+
+	void PushBack(TaskSlot* slot)
+	{
+		slot->SetNext(nullptr);
+		if (m_Tail)
+			m_Tail->SetNext(slot);
+		else
+			m_Head = slot;
+		m_Tail = slot;
+		++m_Size;
+	}
+
+	TaskSlot* PopFront()
+	{
+		TaskSlot* slot = m_Head;
+		if (slot)
+		{
+			m_Head = slot->Next();
+			if (!m_Head)
+				m_Tail = nullptr;
+			slot->SetNext(nullptr);
+			--m_Size;
+		}
+		return slot;
+	}
+
+private:
+	TaskSlot*	m_Head;
+	TaskSlot*	m_Tail;
+	std::size_t	m_Size;
+};
+//-------------------------------------------------------------------------------------------------
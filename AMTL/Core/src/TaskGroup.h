@@ -0,0 +1,170 @@
+//
+// Task groups
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <exception>
+#include <utility>
+
+#include "TaskJoin.h"
+#include "TaskProcessor.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskGroup runs a batch of tasks on a TaskProcessor and joins on all of them at once: Run
+	posts a task and bumps a single counter, Wait helps the pool run tasks until the counter
+	drops to zero. No task gets a future.
+
+	Cancel is cooperative. Tasks that have not started yet are skipped, running ones may poll
+	IsCanceled and return early. A task that throws cancels the group, and Wait rethrows the
+	first exception. A task dropped by a pool shutdown cancels the group as well. Once Wait
+	returns, the group may be reused.
+
+	The destructor cancels whatever has not started and waits for the rest, so unwinding past a
+	group never leaves its tasks pointing at a dead object. Call Wait to run everything.
+*/
+class TaskGroup
+{
+public:
+	explicit TaskGroup(TaskProcessor& pool):
+		m_Pool(pool),
+		m_Canceled(false),
+		m_Failed(false)
+	{
+	}
+
+	~TaskGroup()
+	{
+		if (!m_Join.Finished())
+		{
+			Cancel();
+			m_Join.Wait(m_Pool);
+		}
+	}
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	template<class T, class... Args>
+	void Run(T&& t, Args&&... args)
+	{
+		Run(TaskPriority::Normal, std::forward<T>(t), std::forward<Args>(args)...);
+	}
+
+	template<class T, class... Args>
+	void Run(TaskPriority priority, T&& t, Args&&... args)
+	{
+		Submit(priority, BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
+
+	// returns false if the group was canceled; rethrows the first exception a task threw
+	bool Wait()
+	{
+		m_Join.Wait(m_Pool);
+
+		const bool canceled = m_Canceled.load(std::memory_order_relaxed);
+		m_Canceled.store(false, std::memory_order_relaxed);
+
+		if (m_Failed.load(std::memory_order_relaxed))
+		{
+			m_Failed.store(false, std::memory_order_relaxed);
+			std::exception_ptr error = std::move(m_Error);
+			m_Error = nullptr;
+			std::rethrow_exception(error);
+		}
+		return !canceled;
+	}
+
+	void Cancel()
+	{
+		m_Canceled.store(true, std::memory_order_relaxed);
+	}
+
+	bool IsCanceled() const
+	{
+		return m_Canceled.load(std::memory_order_relaxed);
+	}
+
+private:
+	template<class F>
+	class GroupTask
+	{
+	public:
+		GroupTask(TaskGroup* group, F&& task) : m_Group(group), m_Task(std::move(task)) {}
+
+		void operator()() { m_Group->Execute(m_Task); }
+
+		void OnDrop()
+		{
+			m_Group->Cancel();
+			m_Group->m_Join.Done();
+		}
+
+	private:
+		TaskGroup*	m_Group;
+		F			m_Task;
+	};
+
+	template<class F>
+	void Submit(TaskPriority priority, F&& task)
+	{
+		m_Join.Add();
+		try
+		{
+			m_Pool.Post(priority, GroupTask<F>(this, std::move(task)));
+		}
+		catch (...)
+		{
+			m_Join.Done();
+			throw;
+		}
+	}
+
+	template<class F>
+	void Execute(F& task)
+	{
+		if (!IsCanceled())
+		{
+			try
+			{
+				task();
+			}
+			catch (...)
+			{
+				bool expected = false;
+				if (m_Failed.compare_exchange_strong(expected, true, std::memory_order_relaxed))
+					m_Error = std::current_exception();
+				Cancel();
+			}
+		}
+		m_Join.Done();
+	}
+
+	TaskProcessor&		m_Pool;
+	TaskJoin			m_Join;
+	std::atomic<bool>	m_Canceled;
+	std::atomic<bool>	m_Failed;
+	std::exception_ptr	m_Error;	// written once by whoever sets m_Failed, read after the join
+};
+//-------------------------------------------------------------------------------------------------
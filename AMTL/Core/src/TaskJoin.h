@@ -0,0 +1,101 @@
+//
+// Task join counter
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+
+#include "CpuRelax.h"
+#include "Futex.h"
+#include "TaskProcessor.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskJoin counts outstanding pieces of work, so that a thread can wait for a whole batch of
+	tasks without a future per task. Add before handing work to the pool, Done when a piece
+	finishes, and Wait to help the pool run tasks until the count drops to zero.
+
+	The count and a "waiter is asleep" bit share one futex word. The Done that finishes the
+	batch touches nothing but that word (the wake-up only passes its address to the kernel),
+	so a waiter may destroy the join, typically a local, as soon as it sees zero.
+*/
+class TaskJoin
+{
+public:
+	explicit TaskJoin(int pending = 0) : m_State(pending) {}
+
+	TaskJoin(const TaskJoin&) = delete;
+	TaskJoin& operator=(const TaskJoin&) = delete;
+
+	void Add(int count = 1)
+	{
+		m_State.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	// release: the finished work happens before everything the waiter does after Wait
+	void Done(int count = 1)
+	{
+		const int previous = m_State.fetch_sub(count, std::memory_order_acq_rel);
+		if (previous == (count | SLEEPING))
+			FutexWakeAll(m_State);
+	}
+
+	bool Finished() const
+	{
+		return (m_State.load(std::memory_order_acquire) & ~SLEEPING) == 0;
+	}
+
+	void Wait(TaskProcessor& pool)
+	{
+		for (;;)
+		{
+			if (Finished())
+				return;
+
+			if (pool.RunPendingTask())
+				continue;
+
+			// nothing to help with, the rest is running elsewhere: give it a moment, then sleep
+			for (unsigned i = 0; i < SPIN_LIMIT && !Finished(); ++i)
+				CpuRelax();
+
+			int state = m_State.load(std::memory_order_acquire);
+			if ((state & ~SLEEPING) == 0)
+				return;
+
+			// the bit stays set once a waiter slept, later batches just pay a spare wake-up
+			if (!(state & SLEEPING) &&
+				!m_State.compare_exchange_weak(state, state | SLEEPING, std::memory_order_relaxed))
+				continue;
+
+			FutexWait(m_State, state | SLEEPING);
+		}
+	}
+
+private:
+	constexpr static int SLEEPING = 1 << 30;
+	constexpr static unsigned SPIN_LIMIT = 64;
+
+	std::atomic<int> m_State;
+};
+//-------------------------------------------------------------------------------------------------
@@ -1,44 +1,668 @@
 #include "TaskProcessor.h"
+#include "CpuRelax.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #define DEFAULT_THREAD_COUNT 2
+#define MAX_THREAD_NAME 15
 //-------------------------------------------------------------------------------------------------
-TaskProcessor::TaskProcessor():
-	m_Running(true)
+namespace
 {
-	int count = std::thread::hardware_concurrency();
-	m_Threads.resize((count == 0) ? DEFAULT_THREAD_COUNT : count);
+	// the worker the current thread runs, null for threads outside of any pool
+	thread_local void* t_CurrentWorker = nullptr;
+
+	// victim selection for threads outside the pool that help through RunPendingTask
+	thread_local unsigned t_HelperSeed = 0;
+
+	const unsigned NORMAL_LEVEL = static_cast<unsigned>(TaskPriority::Normal);
+
+	unsigned NextRandom(unsigned& seed)
+	{
+		// xorshift32
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	}
+
+	// the CPUs this process may run on
+	std::vector<unsigned> AvailableCpus()
+	{
+		std::vector<unsigned> cpus;
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			{
+				if (CPU_ISSET(cpu, &set))
+					cpus.push_back(cpu);
+			}
+		}
+#endif
+		if (cpus.empty())
+		{
+			unsigned count = std::thread::hardware_concurrency();
+			count = (count == 0) ? DEFAULT_THREAD_COUNT : count;
+			for (unsigned cpu = 0; cpu < count; ++cpu)
+				cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+
+	// CPUs claimed by pools running with m_IsolateCores; intentionally never destroyed
+	struct IsolatedCores
+	{
+		std::mutex				m_Lock;
+		std::vector<unsigned>	m_Taken;
+	};
+
+	IsolatedCores& GetIsolatedCores()
+	{
+		static IsolatedCores* cores = new IsolatedCores;
+		return *cores;
+	}
+
+	// count == 0 claims every free CPU
+	std::vector<unsigned> ClaimCores(unsigned count)
+	{
+		IsolatedCores& cores = GetIsolatedCores();
+		std::lock_guard<std::mutex> lock(cores.m_Lock);
+
+		std::vector<unsigned> claimed;
+		for (unsigned cpu : AvailableCpus())
+		{
+			if (count != 0 && claimed.size() == count)
+				break;
+			if (std::find(cores.m_Taken.begin(), cores.m_Taken.end(), cpu) == cores.m_Taken.end())
+				claimed.push_back(cpu);
+		}
+
+		if (claimed.empty() || (count != 0 && claimed.size() < count))
+			throw std::runtime_error("TaskProcessor: not enough free CPUs to isolate the pool");
+
+		cores.m_Taken.insert(cores.m_Taken.end(), claimed.begin(), claimed.end());
+		return claimed;
+	}
+
+	void ReleaseCores(const std::vector<unsigned>& claimed)
+	{
+		IsolatedCores& cores = GetIsolatedCores();
+		std::lock_guard<std::mutex> lock(cores.m_Lock);
+		for (unsigned cpu : claimed)
+			cores.m_Taken.erase(std::find(cores.m_Taken.begin(), cores.m_Taken.end(), cpu));
+	}
+
+	// runs on the worker thread itself before it takes any task
+	void ConfigureThread(const std::string& name, unsigned index, const std::vector<unsigned>& cpus)
+	{
+#if defined(__linux__)
+		if (!name.empty())
+		{
+			// keep the index, it is what tells the workers apart
+			const std::string suffix = "/" + std::to_string(index);
+			const std::string thread_name = name.substr(0, MAX_THREAD_NAME - suffix.size()) + suffix;
+			pthread_setname_np(pthread_self(), thread_name.c_str());
+		}
+
+		if (!cpus.empty())
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			for (unsigned cpu : cpus)
+				CPU_SET(cpu, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+#else
+		(void)name;
+		(void)index;
+		(void)cpus;
+#endif
+	}
+
+	// noexcept keeps Post's promise on every thread that runs tasks: an escaping exception
+	// terminates right there, and never unwinds into a helping TaskJoin or Future wait
+	void RunTask(TaskSlot* task) noexcept
+	{
+		task->m_Func();
+	}
+
+	// a due timer's run; dropped at shutdown it gives the entry back like a run that was never
+	// queued
+	class TimerRun
+	{
+	public:
+		explicit TimerRun(TimerEntry* entry) : m_Entry(entry) {}
 
-	for (auto &t : m_Threads)
-		t = std::thread([this]{this->ExecuteLoop(); });
+		void operator()() { m_Entry->Run(); }
+		void OnDrop() { m_Entry->Skip(); }
+
+	private:
+		TimerEntry* m_Entry;
+	};
+
+	// false if the pool was torn down before all the workers came up
+	bool WaitForWorkers(const std::atomic<unsigned>& started, unsigned count, const std::atomic<bool>& running)
+	{
+		SpinWait wait;
+		while (started.load(std::memory_order_acquire) != count)
+		{
+			if (!running.load(std::memory_order_acquire))
+				return false;
+			wait.Once();
+		}
+		return true;
+	}
+}
+//-------------------------------------------------------------------------------------------------
+TaskProcessor::Worker::Worker(TaskProcessor* owner, unsigned index, unsigned node):
+	m_Owner(owner),
+	m_Index(index),
+	m_Node(node),
+	m_Seed(index * 0x9E3779B9u + 1),
+	m_Searches(0)
+{
+}
+//-------------------------------------------------------------------------------------------------
+TaskProcessor::TaskProcessor(const TaskProcessorOptions& options):
+	m_ShutDown(false),
+	m_Dropping(false),
+	m_Exited(0),
+	m_Helped(0),
+	m_Running(true),
+	m_Started(0),
+	m_Timers(&TaskProcessor::DispatchTimer, this)
+{
+	for (std::atomic<long>& pending : m_Pending)
+		pending.store(0, std::memory_order_relaxed);
+
+	const std::vector<unsigned> available = AvailableCpus();
+	for (const std::vector<unsigned>& cpus : options.m_Affinity)
+	{
+		for (unsigned cpu : cpus)
+		{
+			if (std::find(available.begin(), available.end(), cpu) == available.end())
+				throw std::invalid_argument("TaskProcessor: affinity names a CPU the process cannot run on");
+		}
+	}
+
+	unsigned count = options.m_ThreadCount;
+	const std::string name = options.m_Name;
+
+	// everything from claiming the cores on is undone if the pool cannot come up
+	try
+	{
+		if (options.m_IsolateCores)
+		{
+			m_IsolatedCores = ClaimCores(count);
+			count = static_cast<unsigned>(m_IsolatedCores.size());
+		}
+		else if (count == 0)
+		{
+			count = static_cast<unsigned>(available.size());
+		}
+
+		std::vector<std::vector<unsigned>> cpus(count);
+		for (unsigned i = 0; i < count; ++i)
+		{
+			if (options.m_IsolateCores)
+				cpus[i].assign(1, m_IsolatedCores[i]);
+			else if (!options.m_Affinity.empty())
+				cpus[i] = options.m_Affinity[i % options.m_Affinity.size()];
+		}
+
+		// a pinned worker belongs to the node of its first CPU; the others are dealt out over the
+		// nodes like CPU slots, so every node gets workers in proportion to its CPUs
+		const NumaTopology& topology = NumaTopology::System();
+		const std::vector<NumaNode>& numa = topology.Nodes();
+		const bool spread = options.m_NumaAware && numa.size() > 1;
+
+		std::size_t slots = 0;
+		for (const NumaNode& node : numa)
+			slots += node.m_Cpus.size();
+
+		std::vector<unsigned> ids(count, numa.front().m_Id);
+		for (unsigned i = 0; i < count; ++i)
+		{
+			if (!cpus[i].empty())
+			{
+				const int id = topology.NodeOfCpu(cpus[i].front());
+				if (id >= 0)
+					ids[i] = static_cast<unsigned>(id);
+			}
+			else if (spread)
+			{
+				std::size_t slot = static_cast<std::size_t>(i) * slots / count;
+				for (const NumaNode& node : numa)
+				{
+					if (slot < node.m_Cpus.size())
+					{
+						ids[i] = node.m_Id;
+						cpus[i] = node.m_Cpus;
+						break;
+					}
+					slot -= node.m_Cpus.size();
+				}
+			}
+
+			if (ids[i] >= m_NodeIndex.size())
+				m_NodeIndex.resize(ids[i] + 1, -1);
+			if (m_NodeIndex[ids[i]] < 0)
+			{
+				m_NodeIndex[ids[i]] = static_cast<int>(m_Nodes.size());
+				m_Nodes.emplace_back(new Node);
+				m_Nodes.back()->m_Id = ids[i];
+				SetLockName(m_Nodes.back()->m_Lock, "TaskProcessor::Node::m_Lock");
+			}
+			m_Nodes[m_NodeIndex[ids[i]]]->m_Workers.push_back(i);
+		}
+
+		m_Workers.resize(count);
+
+		for (unsigned i = 0; i < count; ++i)
+		{
+			const unsigned node = static_cast<unsigned>(m_NodeIndex[ids[i]]);
+			const std::vector<unsigned> affinity = cpus[i];
+			m_Threads.emplace_back([this, i, node, name, affinity, count]
+			{
+				ConfigureThread(name, i, affinity);
+
+				// built after pinning, so the deque is first touched (and placed) on the worker's node
+				m_Workers[i].reset(new Worker(this, i, node));
+				m_Started.fetch_add(1, std::memory_order_release);
+
+				// all deques must exist before the first worker starts stealing
+				if (WaitForWorkers(m_Started, count, m_Running))
+					this->ExecuteLoop(*m_Workers[i]);
+			});
+		}
+	}
+	catch (...)
+	{
+		// the workers that did start wait for the rest, which will never come: let them go
+		m_Running.store(false, std::memory_order_release);
+		for (std::thread& thread : m_Threads)
+			thread.join();
+
+		if (!m_IsolatedCores.empty())
+			ReleaseCores(m_IsolatedCores);
+		throw;
+	}
+
+	WaitForWorkers(m_Started, count, m_Running);
 }
 //-------------------------------------------------------------------------------------------------
 TaskProcessor::~TaskProcessor()
 {
+	Shutdown(DrainPolicy::All());
+
+	if (!m_IsolatedCores.empty())
+		ReleaseCores(m_IsolatedCores);
+}
+//-------------------------------------------------------------------------------------------------
+std::size_t TaskProcessor::Shutdown(const DrainPolicy& policy)
+{
+	std::lock_guard<std::mutex> lock(m_ShutdownLock);
+	if (!m_ShutDown)
 	{
-		std::lock_guard<Spinlock> lock(m_TasksLock);
-		m_Running = false;
+		m_ShutDown = true;
+
+		// timers first, their last runs still find the workers
+		m_Timers.Stop();
+
+		if (policy.m_Mode == DrainPolicy::Mode::Drop)
+			m_Dropping.store(true, std::memory_order_relaxed);
+
+		m_Running.store(false, std::memory_order_seq_cst);
+		m_Idle.NotifyAll();
+
+		if (policy.m_Mode == DrainPolicy::Mode::Deadline)
+		{
+			// workers leave once they run dry; whoever is still busy at the deadline is told
+			// to stop after its current task
+			const int count = static_cast<int>(m_Threads.size());
+			for (;;)
+			{
+				const int exited = m_Exited.load(std::memory_order_acquire);
+				if (exited == count)
+					break;
+
+				const auto now = std::chrono::steady_clock::now();
+				if (now >= policy.m_Deadline)
+				{
+					m_Dropping.store(true, std::memory_order_relaxed);
+					break;
+				}
+				FutexWaitFor(m_Exited, exited, policy.m_Deadline - now);
+			}
+		}
+
+		for (std::thread& thread : m_Threads)
+			thread.join();
 	}
-	m_Notify.notify_all();
-	
-	for (auto &t : m_Threads)
-		t.join();
+
+	return DropQueued();
 }
 //-------------------------------------------------------------------------------------------------
-void TaskProcessor::ExecuteLoop()
+TaskProcessorStats TaskProcessor::Stats() const
 {
-	while (true)
+	static_assert(sizeof(TaskProcessorStats::m_QueuedByPriority) / sizeof(std::size_t) == PRIORITY_COUNT,
+		"TaskProcessorStats::m_QueuedByPriority needs an entry per priority level");
+
+	TaskProcessorStats stats;
+	stats.m_Queued = 0;
+	for (std::size_t& queued : stats.m_QueuedByPriority)
+		queued = 0;
+	stats.m_Executed = 0;
+	stats.m_Helped = m_Helped.load(std::memory_order_relaxed);
+
+	stats.m_Workers.resize(m_Workers.size());
+	for (std::size_t i = 0; i < m_Workers.size(); ++i)
 	{
-		std::unique_lock<Spinlock> lock(m_TasksLock);
-		m_Notify.wait(lock, [&](){ return !m_AllTasks.empty() || !m_Running; });
+		const Worker& worker = *m_Workers[i];
+		TaskWorkerStats& entry = stats.m_Workers[i];
 
-		if (!m_Running && m_AllTasks.empty())
-			return;
+		entry.m_Index = worker.m_Index;
+		entry.m_Node = m_Nodes[worker.m_Node]->m_Id;
+		entry.m_Queued = 0;
+		for (unsigned level = 0; level < PRIORITY_COUNT; ++level)
+		{
+			const std::size_t queued = worker.m_Tasks[level].Size();
+			entry.m_Queued += queued;
+			stats.m_QueuedByPriority[level] += queued;
+		}
+		worker.m_Stats.Snapshot(entry);
 
-		auto task = std::move(m_AllTasks.front());
-		m_AllTasks.pop_front();
-		lock.unlock();
+		stats.m_Executed += entry.m_Executed;
+		stats.m_WaitTime.Merge(entry.m_WaitTime);
+		stats.m_RunTime.Merge(entry.m_RunTime);
+	}
 
-		task();
+	for (const std::unique_ptr<Node>& node : m_Nodes)
+	{
+		std::lock_guard<TasksLock> lock(node->m_Lock);
+		for (unsigned level = 0; level < PRIORITY_COUNT; ++level)
+			stats.m_QueuedByPriority[level] += node->m_Tasks[level].Size();
 	}
+
+	for (std::size_t queued : stats.m_QueuedByPriority)
+		stats.m_Queued += queued;
+	return stats;
 }
-//-------------------------------------------------------------------------------------------------
\ No newline at end of file
+//-------------------------------------------------------------------------------------------------
+std::size_t TaskProcessor::DropQueued()
+{
+	// the workers are joined, so their deques are only emptied from here. Dropping a task may
+	// add another (a broken future scheduling its continuation), hence the repeat.
+	std::size_t dropped = 0;
+	for (;;)
+	{
+		std::size_t pass = 0;
+		for (unsigned level = 0; level < PRIORITY_COUNT; ++level)
+		{
+			std::size_t count = 0;
+			TaskSlot* task = nullptr;
+
+			for (const std::unique_ptr<Worker>& worker : m_Workers)
+			{
+				while (worker->m_Tasks[level].Steal(task))
+				{
+					task->m_Func.Drop();
+					TaskSlotPool::Free(task);
+					++count;
+				}
+			}
+
+			for (const std::unique_ptr<Node>& node : m_Nodes)
+			{
+				while ((task = PopInjected(*node, level)) != nullptr)
+				{
+					task->m_Func.Drop();
+					TaskSlotPool::Free(task);
+					++count;
+				}
+			}
+
+			if (level != NORMAL_LEVEL)
+				m_Pending[level].fetch_sub(static_cast<long>(count), std::memory_order_relaxed);
+			pass += count;
+		}
+
+		if (pass == 0)
+			return dropped;
+		dropped += pass;
+	}
+}
+//-------------------------------------------------------------------------------------------------
+void TaskProcessor::DispatchTimer(void* context, TimerEntry* entry)
+{
+	// runs on the timer thread, where an exception would terminate the process: a run that
+	// gets no slot is skipped instead
+	try
+	{
+		static_cast<TaskProcessor*>(context)->Post(TimerRun(entry));
+	}
+	catch (...)
+	{
+		entry->Skip();
+	}
+}
+//-------------------------------------------------------------------------------------------------
+int TaskProcessor::NodeIndex(unsigned id) const
+{
+	return (id < m_NodeIndex.size()) ? m_NodeIndex[id] : -1;
+}
+//-------------------------------------------------------------------------------------------------
+unsigned TaskProcessor::SubmitterNode() const
+{
+	if (m_Nodes.size() < 2)
+		return 0;
+
+	const int id = NumaTopology::System().CurrentNode();
+	const int node = (id >= 0) ? NodeIndex(static_cast<unsigned>(id)) : -1;
+	return (node >= 0) ? static_cast<unsigned>(node) : 0;
+}
+//-------------------------------------------------------------------------------------------------
+void TaskProcessor::Push(TaskSlot* task, int node, unsigned level)
+{
+	Worker* worker = static_cast<Worker*>(t_CurrentWorker);
+	const bool own = worker && worker->m_Owner == this;
+
+	task->m_Queued = TaskStatsRecorder::Clock();
+
+	// counted before the task is visible, so a search never skips a level that holds one
+	if (level != NORMAL_LEVEL)
+		m_Pending[level].fetch_add(1, std::memory_order_relaxed);
+
+	if (own && (node < 0 || static_cast<unsigned>(node) == worker->m_Node))
+	{
+		worker->m_Tasks[level].Push(task);
+	}
+	else
+	{
+		if (node < 0)
+			node = static_cast<int>(own ? worker->m_Node : SubmitterNode());
+
+		Node& target = *m_Nodes[node];
+		std::lock_guard<TasksLock> lock(target.m_Lock);
+		target.m_Tasks[level].PushBack(task);
+	}
+
+	// pairs with PrepareWait in ExecuteLoop: either the parking worker sees the new task
+	// on its re-check, or we see it parked and wake it
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	m_Idle.NotifyOne();
+}
+//-------------------------------------------------------------------------------------------------
+bool TaskProcessor::RunPendingTask()
+{
+	Worker* worker = static_cast<Worker*>(t_CurrentWorker);
+
+	if (worker && worker->m_Owner == this)
+	{
+		TaskSlot* task = FindTask(*worker);
+		if (!task)
+			return false;
+
+		Execute(*worker, task);
+		return true;
+	}
+
+	// once Shutdown has begun only the workers take what is left; tasks added after it are
+	// not run, not even by a helper
+	if (!m_Running.load(std::memory_order_relaxed))
+		return false;
+
+	if (t_HelperSeed == 0)
+		t_HelperSeed = static_cast<unsigned>(reinterpret_cast<std::uintptr_t>(&t_HelperSeed) >> 4) | 1;
+
+	TaskSlot* task = FindTask(nullptr, SubmitterNode(), t_HelperSeed, false);
+	if (!task)
+		return false;
+
+	m_Helped.fetch_add(1, std::memory_order_relaxed);
+	RunTask(task);
+	TaskSlotPool::Free(task);
+	return true;
+}
+//-------------------------------------------------------------------------------------------------
+TaskSlot* TaskProcessor::FindTask(Worker& worker)
+{
+	const bool lowest_first = (++worker.m_Searches % STARVATION_GUARD) == 0;
+	return FindTask(&worker, worker.m_Node, worker.m_Seed, lowest_first);
+}
+//-------------------------------------------------------------------------------------------------
+TaskSlot* TaskProcessor::FindTask(Worker* self, unsigned home, unsigned& seed, bool lowest_first)
+{
+	for (unsigned i = 0; i < PRIORITY_COUNT; ++i)
+	{
+		const unsigned level = lowest_first ? PRIORITY_COUNT - 1 - i : i;
+
+		// seq_cst, like the fence in Push: a worker about to park must see the count of a
+		// task pushed before the submitter looked for parked workers
+		if (level != NORMAL_LEVEL && m_Pending[level].load(std::memory_order_seq_cst) == 0)
+			continue;
+
+		TaskSlot* task = FindTaskAtLevel(self, home, seed, level);
+		if (task)
+		{
+			if (level != NORMAL_LEVEL)
+				m_Pending[level].fetch_sub(1, std::memory_order_relaxed);
+			return task;
+		}
+	}
+
+	return nullptr;
+}
+//-------------------------------------------------------------------------------------------------
+TaskSlot* TaskProcessor::FindTaskAtLevel(Worker* self, unsigned home, unsigned& seed, unsigned level)
+{
+	TaskSlot* task = nullptr;
+	if (self && self->m_Tasks[level].Pop(task))
+		return task;
+
+	// the home node first, then the other nodes in turn
+	const unsigned count = static_cast<unsigned>(m_Nodes.size());
+	for (unsigned i = 0; i < count; ++i)
+	{
+		Node& node = *m_Nodes[(home + i) % count];
+
+		task = PopInjected(node, level);
+		if (task)
+			return task;
+
+		task = Steal(self, seed, node, level);
+		if (task)
+		{
+			if (self)
+				self->m_Stats.Stolen();
+			return task;
+		}
+	}
+
+	return nullptr;
+}
+//-------------------------------------------------------------------------------------------------
+TaskSlot* TaskProcessor::PopInjected(Node& node, unsigned level)
+{
+	std::lock_guard<TasksLock> lock(node.m_Lock);
+	return node.m_Tasks[level].PopFront();
+}
+//-------------------------------------------------------------------------------------------------
+TaskSlot* TaskProcessor::Steal(const Worker* thief, unsigned& seed, const Node& node, unsigned level)
+{
+	const unsigned count = static_cast<unsigned>(node.m_Workers.size());
+	if (count == 0)
+		return nullptr;
+
+	// start at a random victim of the node and sweep everyone else there once
+	const unsigned start = NextRandom(seed) % count;
+	for (unsigned i = 0; i < count; ++i)
+	{
+		Worker& victim = *m_Workers[node.m_Workers[(start + i) % count]];
+		if (&victim == thief)
+			continue;
+
+		TaskSlot* task = nullptr;
+		if (victim.m_Tasks[level].Steal(task))
+			return task;
+	}
+
+	return nullptr;
+}
+//-------------------------------------------------------------------------------------------------
+void TaskProcessor::Execute(Worker& worker, TaskSlot* task)
+{
+	const std::uint64_t started = TaskStatsRecorder::Clock();
+	RunTask(task);
+	worker.m_Stats.Ran(task->m_Queued, started, TaskStatsRecorder::Clock());
+	worker.m_Stats.Executed();
+
+	TaskSlotPool::Free(task);
+}
+//-------------------------------------------------------------------------------------------------
+void TaskProcessor::ExecuteLoop(Worker& worker)
+{
+	t_CurrentWorker = &worker;
+
+	while (!m_Dropping.load(std::memory_order_relaxed))
+	{
+		TaskSlot* task = FindTask(worker);
+
+		if (!task)
+		{
+			const EventCount::Key key = m_Idle.PrepareWait();
+
+			task = FindTask(worker);
+			if (!task)
+			{
+				if (!m_Running.load(std::memory_order_seq_cst))
+				{
+					m_Idle.CancelWait();
+					break;
+				}
+				worker.m_Stats.Parked();
+				m_Idle.Wait(key);
+				continue;
+			}
+
+			m_Idle.CancelWait();
+		}
+
+		Execute(worker, task);
+	}
+
+	t_CurrentWorker = nullptr;
+
+	m_Exited.fetch_add(1, std::memory_order_release);
+	FutexWakeAll(m_Exited);
+}
+//-------------------------------------------------------------------------------------------------
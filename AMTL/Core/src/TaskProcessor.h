@@ -25,48 +25,404 @@
 #pragma once
 //-------------------------------------------------------------------------------------------------
 #include <vector>
-#include <list>
 #include <thread>
-#include <condition_variable>
+#include <mutex>
 #include <future>
+#include <memory>
+#include <atomic>
+#include <string>
+#include <chrono>
+#include <stdexcept>
 
 #include "SpinLock.h"
+#include "TicketLock.h"
+#include "MCSLock.h"
+#include "CLHLock.h"
+#include "AdaptiveMutex.h"
+#include "EventCount.h"
+#include "LockStats.h"
+#include "NumaTopology.h"
+#include "TaskStats.h"
+#include "TimerWheel.h"
+#include "WorkStealingDeque.h"
+#include "Task.h"
 //-------------------------------------------------------------------------------------------------
+/*
+	AMTL_TASKPROCESSOR_LOCK is the lock guarding each injection queue. Spinlock is cheapest when
+	few threads submit from outside the pool; TicketLock, MCSLock or CLHLock keep heavy
+	contention fair; AdaptiveMutex parks waiters whose lock holder was preempted. Define it
+	for the whole project (it changes the class layout).
+*/
+#ifndef AMTL_TASKPROCESSOR_LOCK
+#define AMTL_TASKPROCESSOR_LOCK Spinlock
+#endif
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskProcessorOptions configure the worker threads of a TaskProcessor.
+
+	CPUs are given as the numbers the OS uses (as in /proc/cpuinfo or taskset). Affinity and
+	names are applied on Linux and ignored elsewhere.
+*/
+struct TaskProcessorOptions
+{
+	// 0 means one worker per CPU the process may run on (or per free CPU with m_IsolateCores)
+	unsigned							m_ThreadCount = 0;
+
+	// workers are named "<m_Name>/<index>", m_Name cut so that fits the 15 characters Linux keeps
+	std::string							m_Name;
+
+	// worker i may only run on m_Affinity[i % m_Affinity.size()]; empty means no pinning
+	std::vector<std::vector<unsigned>>	m_Affinity;
+
+	// pin every worker to a CPU of its own that no other isolating pool in the process uses;
+	// the CPUs are handed back when the pool is destroyed. Overrides m_Affinity.
+	bool								m_IsolateCores = false;
+
+	// on machines with several NUMA nodes, spread workers without an explicit affinity over
+	// the nodes in proportion to their CPUs and keep each one on its node's CPUs
+	bool								m_NumaAware = true;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	NodeHint asks for a task to be queued on the workers of one NUMA node, typically the node
+	that holds the memory the task works on. m_Node is the kernel's node number. A hint naming
+	a node the pool has no workers on is ignored.
+*/
+struct NodeHint
+{
+	explicit NodeHint(unsigned node) : m_Node(node) {}
+
+	unsigned m_Node;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskPriority orders tasks that are waiting at the same time; it never preempts a running
+	task. Add and Post without a priority use Normal.
+*/
+enum class TaskPriority
+{
+	High,
+	Normal,
+	Low
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskDropped is what waiters see when the task they wait for was dropped by a shutdown
+	instead of run.
+*/
+class TaskDropped : public std::runtime_error
+{
+public:
+	TaskDropped() : std::runtime_error("TaskProcessor: task dropped at shutdown") {}
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	DrainPolicy tells Shutdown what to do with the tasks that are still queued.
+
+	All runs everything, including the tasks those tasks add. Until and For do the same, but
+	at the deadline the workers stop taking new tasks and whatever is left is dropped. Drop
+	lets the running tasks finish and drops the rest right away.
+
+	Dropping a task destroys it without running it, after giving it the chance to release
+	whoever waits for it (see TaskFunction::Drop):
+
+		Async, Then				the Future fails with TaskDropped
+		ParallelFor/Reduce		the loop throws TaskDropped
+		schedule_on				the co_await throws TaskDropped, on the thread that drops
+		TaskGroup				the dropped tasks count as canceled, Wait returns false
+		Strand					its queued tasks are dropped along with its drain
+		timers					the run is skipped
+		Add, Strand::Add		the std::future fails with std::future_errc::broken_promise;
+								nothing else breaks those promises
+*/
+struct DrainPolicy
+{
+	enum class Mode
+	{
+		All,
+		Deadline,
+		Drop
+	};
+
+	static DrainPolicy All() { return DrainPolicy(Mode::All); }
+	static DrainPolicy Drop() { return DrainPolicy(Mode::Drop); }
+
+	static DrainPolicy Until(std::chrono::steady_clock::time_point deadline)
+	{
+		DrainPolicy policy(Mode::Deadline);
+		policy.m_Deadline = deadline;
+		return policy;
+	}
+
+	template<class Rep, class Period>
+	static DrainPolicy For(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		return Until(std::chrono::steady_clock::now() +
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout));
+	}
+
+	Mode									m_Mode;
+	std::chrono::steady_clock::time_point	m_Deadline;
+
+private:
+	explicit DrainPolicy(Mode mode) : m_Mode(mode) {}
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskProcessor is a work-stealing thread pool.
+
+	Every worker owns a Chase-Lev deque. Tasks added from inside a worker go to the bottom of
+	that worker's deque and are taken back LIFO by the owner, without touching shared state.
+	Tasks added from any other thread go to the injection queue of the NUMA node the submitter
+	runs on (or the node it names with a NodeHint). Workers are grouped by node: an idle worker
+	first drains its own deque, then its node's injection queue, then steals from the top of
+	randomly chosen victims on its node, and only then turns to the queues and workers of the
+	other nodes. Each worker builds its deque on its own thread after pinning, so the deque's
+	memory is placed on the worker's node. Workers that find nothing park on the m_Idle event
+	count; when nobody is parked a submitter pays a single load to find that out.
+
+	Every priority level has its own deques and injection queues, and the search above runs
+	level by level, highest first. To keep a steady stream of urgent work from starving the
+	background, every STARVATION_GUARD-th search runs lowest level first.
+
+	Shutdown stops the workers according to a DrainPolicy; the destructor shuts down with
+	DrainPolicy::All unless Shutdown ran before.
+*/
 class TaskProcessor
 {
 public:
-	TaskProcessor();
+	// throws std::invalid_argument for an affinity naming a CPU the process cannot use, and
+	// std::runtime_error if m_IsolateCores cannot find enough free CPUs
+	explicit TaskProcessor(const TaskProcessorOptions& options = TaskProcessorOptions());
 	~TaskProcessor();
 
+	TaskProcessor(const TaskProcessor&) = delete;
+	TaskProcessor& operator=(const TaskProcessor&) = delete;
+
+	/*
+		Shutdown stops the timers and the workers and returns the number of tasks dropped,
+		queued but never run. Tasks added after Shutdown are not run, a later Shutdown or the
+		destructor drops them. Concurrent calls are serialized. Not to be called from a task of
+		this pool.
+	*/
+	std::size_t Shutdown(const DrainPolicy& policy = DrainPolicy::All());
+
+	unsigned ThreadCount() const { return static_cast<unsigned>(m_Workers.size()); }
+
+	// number of NUMA nodes the workers are spread over
+	unsigned NodeCount() const { return static_cast<unsigned>(m_Nodes.size()); }
+
+	/*
+		Stats collects the queue depths and the per-worker counters. The counters cost each
+		worker a few plain stores per task; the wait and run time histograms are filled only
+		when the project is built with AMTL_TASKPROCESSOR_STATS, which adds two clock reads per
+		task and one per submission.
+	*/
+	TaskProcessorStats Stats() const;
+
+	/*
+		Add schedules t(args...) and returns a future for its result.
+		The callable and its arguments are moved into a pooled slot, so the only allocation
+		left is the shared state of the returned future.
+	*/
 	template<class T, class... Args>
 	auto Add(T&& t, Args&&... args)
 		-> std::future<typename std::result_of<T(Args...)>::type>
 	{
-		using return_type = typename std::result_of<T(Args...)>::type;
+		return AddBound<typename std::result_of<T(Args...)>::type>(-1, TaskPriority::Normal,
+			BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
 
-		auto task = std::make_shared<std::packaged_task<return_type()>>
-			(
-				std::bind(std::forward<T>(t), std::forward<Args>(args)...)
-			);
+	// as above, queued at the given priority
+	template<class T, class... Args>
+	auto Add(TaskPriority priority, T&& t, Args&&... args)
+		-> std::future<typename std::result_of<T(Args...)>::type>
+	{
+		return AddBound<typename std::result_of<T(Args...)>::type>(-1, priority,
+			BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
 
-		auto res = task->get_future();
-		{
-			std::lock_guard<Spinlock> lock(m_TasksLock);
-			m_AllTasks.emplace(m_AllTasks.end(), [task](){ (*task)(); });
-		}
-		m_Notify.notify_one();
+	// as above, queued for the workers of the given NUMA node
+	template<class T, class... Args>
+	auto Add(NodeHint hint, T&& t, Args&&... args)
+		-> std::future<typename std::result_of<T(Args...)>::type>
+	{
+		return AddBound<typename std::result_of<T(Args...)>::type>(NodeIndex(hint.m_Node), TaskPriority::Normal,
+			BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
 
-		return res;
+	template<class T, class... Args>
+	auto Add(NodeHint hint, TaskPriority priority, T&& t, Args&&... args)
+		-> std::future<typename std::result_of<T(Args...)>::type>
+	{
+		return AddBound<typename std::result_of<T(Args...)>::type>(NodeIndex(hint.m_Node), priority,
+			BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
+
+	/*
+		Post schedules t(args...) without creating a future; in the steady state it does
+		not allocate at all. An exception escaping a posted task terminates the process.
+	*/
+	template<class T, class... Args>
+	void Post(T&& t, Args&&... args)
+	{
+		Submit(-1, TaskPriority::Normal, BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
+
+	// as above, queued at the given priority
+	template<class T, class... Args>
+	void Post(TaskPriority priority, T&& t, Args&&... args)
+	{
+		Submit(-1, priority, BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
+
+	// as above, queued for the workers of the given NUMA node
+	template<class T, class... Args>
+	void Post(NodeHint hint, T&& t, Args&&... args)
+	{
+		Submit(NodeIndex(hint.m_Node), TaskPriority::Normal, BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
+
+	template<class T, class... Args>
+	void Post(NodeHint hint, TaskPriority priority, T&& t, Args&&... args)
+	{
+		Submit(NodeIndex(hint.m_Node), priority, BindTask(std::forward<T>(t), std::forward<Args>(args)...));
+	}
+
+	/*
+		AddAfter, AddAt and AddEvery run t(args...) on the pool later without tying up a worker
+		while they wait: a timer wheel, serviced by one timer thread per pool, queues the task
+		when it is due (1 ms resolution, never early). AddEvery runs at a fixed rate, first after
+		one period, and skips a period while the previous run is still queued or running.
+		Timers that have not fired when the pool is destroyed are dropped, and so is a run that
+		finds no memory to be queued. As with Post, an exception escaping a timer task terminates
+		the process.
+	*/
+	template<class Rep, class Period, class T, class... Args>
+	TimerHandle AddAfter(std::chrono::duration<Rep, Period> delay, T&& t, Args&&... args)
+	{
+		return AddAt(TimerWheel::Clock::now() + std::chrono::duration_cast<TimerWheel::Clock::duration>(delay),
+			std::forward<T>(t), std::forward<Args>(args)...);
+	}
+
+	template<class T, class... Args>
+	TimerHandle AddAt(TimerWheel::Clock::time_point when, T&& t, Args&&... args)
+	{
+		return m_Timers.Schedule(when, TimerWheel::Clock::duration::zero(),
+			TaskFunction(BindTask(std::forward<T>(t), std::forward<Args>(args)...)));
+	}
+
+	// throws std::invalid_argument for a period that is not positive
+	template<class Rep, class Period, class T, class... Args>
+	TimerHandle AddEvery(std::chrono::duration<Rep, Period> period, T&& t, Args&&... args)
+	{
+		const auto interval = std::chrono::duration_cast<TimerWheel::Clock::duration>(period);
+		if (interval <= TimerWheel::Clock::duration::zero())
+			throw std::invalid_argument("TaskProcessor::AddEvery needs a positive period");
+
+		return m_Timers.Schedule(TimerWheel::Clock::now() + interval, interval,
+			TaskFunction(BindTask(std::forward<T>(t), std::forward<Args>(args)...)));
 	}
 
+	/*
+		RunPendingTask runs one queued task on the calling thread, if it can find one, and
+		returns false if it could not. A thread waiting for work it handed to the pool calls it
+		to help instead of blocking; any thread may call it. Once Shutdown has begun only the
+		pool's own workers find anything.
+	*/
+	bool RunPendingTask();
+
 private:
-	void ExecuteLoop();
+	typedef AMTL_TASKPROCESSOR_LOCK TasksLock;
+
+	constexpr static unsigned PRIORITY_COUNT = static_cast<unsigned>(TaskPriority::Low) + 1;
+	constexpr static unsigned STARVATION_GUARD = 16;
+
+	struct Worker
+	{
+		Worker(TaskProcessor* owner, unsigned index, unsigned node);
+
+		TaskProcessor*				m_Owner;
+		unsigned					m_Index;
+		unsigned					m_Node;		// index into m_Nodes
+		unsigned					m_Seed;		// victim selection
+		unsigned					m_Searches;	// drives the starvation guard
+		WorkStealingDeque<TaskSlot*>	m_Tasks[PRIORITY_COUNT];
+		TaskStatsRecorder			m_Stats;
+	};
+
+	// the workers of one NUMA node and the injection queues they serve first
+	struct alignas(64) Node
+	{
+		TaskList 				m_Tasks[PRIORITY_COUNT];
+		TasksLock 				m_Lock;
+		unsigned				m_Id;		// kernel node number
+		std::vector<unsigned>	m_Workers;	// indices into m_Workers, the local victims
+	};
+
+	template<class R, class F>
+	std::future<R> AddBound(int node, TaskPriority priority, F&& f)
+	{
+		std::packaged_task<R()> task(std::forward<F>(f));
+		auto res = task.get_future();
+
+		Submit(node, priority, std::move(task));
+		return res;
+	}
+
+	// node is an index into m_Nodes, -1 for the submitter's own node
+	template<class F>
+	void Submit(int node, TaskPriority priority, F&& f)
+	{
+		TaskSlot* slot = TaskSlotPool::Allocate();
+		try
+		{
+			slot->m_Func.Assign(std::forward<F>(f));
+		}
+		catch (...)
+		{
+			TaskSlotPool::Free(slot);
+			throw;
+		}
+		Push(slot, node, static_cast<unsigned>(priority));
+	}
+
+	static void DispatchTimer(void* context, TimerEntry* entry);
+
+	int NodeIndex(unsigned id) const;
+	void Push(TaskSlot* task, int node, unsigned level);
+	unsigned SubmitterNode() const;
+
+	// self is null for a helping thread that is not a worker of this pool
+	TaskSlot* FindTask(Worker& worker);
+	TaskSlot* FindTask(Worker* self, unsigned home, unsigned& seed, bool lowest_first);
+	TaskSlot* FindTaskAtLevel(Worker* self, unsigned home, unsigned& seed, unsigned level);
+	TaskSlot* PopInjected(Node& node, unsigned level);
+	TaskSlot* Steal(const Worker* thief, unsigned& seed, const Node& node, unsigned level);
+	void Execute(Worker& worker, TaskSlot* task);
+	void ExecuteLoop(Worker& worker);
+	std::size_t DropQueued();
+
+	std::vector<std::unique_ptr<Node>> m_Nodes;
+	std::vector<int>		m_NodeIndex;	// kernel node number -> index into m_Nodes, -1 if unused
+
+	std::mutex				m_ShutdownLock;
+	bool					m_ShutDown;		// the workers are gone, guarded by m_ShutdownLock
+	std::atomic<bool>		m_Dropping;		// workers stop taking tasks
+	std::atomic<int>		m_Exited;		// workers out of ExecuteLoop, a futex word
+	std::atomic<std::uint64_t> m_Helped;	// tasks run by threads outside the pool
+
+	std::atomic<bool> 		m_Running;
+	std::atomic<unsigned>	m_Started;		// workers that have built their Worker
+	EventCount				m_Idle;			// parked workers
+	TimerWheel				m_Timers;
 
-	std::list<std::function<void()>> m_AllTasks;
-	Spinlock m_TasksLock;
+	std::vector<std::unique_ptr<Worker>> m_Workers;	// filled in by the worker threads themselves
+	std::vector<std::thread> m_Threads;
+	std::vector<unsigned>	m_IsolatedCores;	// claimed with m_IsolateCores, released on destruction
 
-	bool 							m_Running;
-	std::condition_variable_any		m_Notify;
-	std::vector<std::thread> 		m_Threads;
+	// queued tasks per level, an upper bound so that searches can skip empty levels. Normal
+	// is not counted: nearly every task uses it, and it would turn into a hot shared counter.
+	alignas(64) std::atomic<long> m_Pending[PRIORITY_COUNT];
 };
 //-------------------------------------------------------------------------------------------------
\ No newline at end of file
@@ -0,0 +1,271 @@
+//
+// Task statistics
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(AMTL_TASKPROCESSOR_STATS)
+#include <chrono>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskHistogram is a log-linear latency histogram in the spirit of HdrHistogram: values below
+	SUB_COUNT get a bucket each, and every power of two above that is split into SUB_COUNT
+	buckets, so any recorded value is known to within 1/SUB_COUNT (12.5%) of itself. Values
+	are nanoseconds; anything from 2^MAX_BITS ns (about 18 minutes) up lands in the last bucket.
+
+	It is the snapshot form: plain counters, cheap to copy and to merge.
+*/
+class TaskHistogram
+{
+public:
+	constexpr static unsigned SUB_BITS = 3;
+	constexpr static unsigned SUB_COUNT = 1u << SUB_BITS;
+	constexpr static unsigned MAX_BITS = 40;
+	constexpr static unsigned BUCKET_COUNT = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+	TaskHistogram() : m_Buckets(), m_Count(0), m_Total(0), m_Max(0) {}
+
+	static unsigned BucketOf(std::uint64_t value)
+	{
+		if (value < SUB_COUNT)
+			return static_cast<unsigned>(value);
+		if (value >> MAX_BITS)
+			return BUCKET_COUNT - 1;
+
+		const unsigned shift = HighestBit(value) - SUB_BITS;
+		return (shift + 1) * SUB_COUNT + static_cast<unsigned>((value >> shift) & (SUB_COUNT - 1));
+	}
+
+	// the largest value that falls into the bucket
+	static std::uint64_t BucketLimit(unsigned bucket)
+	{
+		if (bucket < SUB_COUNT)
+			return bucket;
+
+		const unsigned shift = bucket / SUB_COUNT - 1;
+		const std::uint64_t low = static_cast<std::uint64_t>(SUB_COUNT + bucket % SUB_COUNT) << shift;
+		return low + (std::uint64_t(1) << shift) - 1;
+	}
+
+	void Record(std::uint64_t value)
+	{
+		++m_Buckets[BucketOf(value)];
+		++m_Count;
+		m_Total += value;
+		if (value > m_Max)
+			m_Max = value;
+	}
+
+	void Merge(const TaskHistogram& other)
+	{
+		for (unsigned i = 0; i < BUCKET_COUNT; ++i)
+			m_Buckets[i] += other.m_Buckets[i];
+		m_Count += other.m_Count;
+		m_Total += other.m_Total;
+		if (other.m_Max > m_Max)
+			m_Max = other.m_Max;
+	}
+
+	std::uint64_t Count() const { return m_Count; }
+	std::uint64_t Total() const { return m_Total; }
+	std::uint64_t Max() const { return m_Max; }
+	std::uint64_t Mean() const { return m_Count ? m_Total / m_Count : 0; }
+	std::uint64_t Bucket(unsigned bucket) const { return m_Buckets[bucket]; }
+
+	// a value that at least fraction (0..1) of the samples do not exceed, 0 without samples
+	std::uint64_t Percentile(double fraction) const
+	{
+		if (m_Count == 0)
+			return 0;
+
+		std::uint64_t rank = static_cast<std::uint64_t>(fraction * static_cast<double>(m_Count) + 0.5);
+		if (rank == 0)
+			rank = 1;
+
+		std::uint64_t seen = 0;
+		for (unsigned i = 0; i < BUCKET_COUNT; ++i)
+		{
+			seen += m_Buckets[i];
+			if (seen >= rank)
+				return BucketLimit(i) < m_Max ? BucketLimit(i) : m_Max;
+		}
+		return m_Max;
+	}
+
+private:
+	friend class TaskStatsRecorder;
+
+	static unsigned HighestBit(std::uint64_t value)
+	{
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanReverse64(&index, value);
+		return static_cast<unsigned>(index);
+#else
+		return 63u - static_cast<unsigned>(__builtin_clzll(value));
+#endif
+	}
+
+	std::uint64_t	m_Buckets[BUCKET_COUNT];
+	std::uint64_t	m_Count;
+	std::uint64_t	m_Total;
+	std::uint64_t	m_Max;
+};
+//-------------------------------------------------------------------------------------------------
+struct TaskWorkerStats
+{
+	unsigned		m_Index;
+	unsigned		m_Node;				// kernel node number
+	std::size_t		m_Queued;			// tasks in the worker's own deques
+	std::uint64_t	m_Executed;
+	std::uint64_t	m_Stolen;			// of those, taken from another worker's deque
+	std::uint64_t	m_Parked;			// times the worker ran out of work and went to sleep
+
+	// from enqueue to start, and from start to finish; empty without AMTL_TASKPROCESSOR_STATS
+	TaskHistogram	m_WaitTime;
+	TaskHistogram	m_RunTime;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskProcessorStats is a snapshot of a pool, taken by TaskProcessor::Stats. The counters are
+	read one by one while the workers keep going, so they are consistent only roughly: good for
+	rates and trends, not for exact accounting.
+*/
+struct TaskProcessorStats
+{
+	std::size_t		m_Queued;			// waiting tasks, in deques and injection queues
+	std::size_t		m_QueuedByPriority[3];	// indexed by TaskPriority: High, Normal, Low
+	std::uint64_t	m_Executed;			// by workers, tasks helped along by other threads excluded
+	std::uint64_t	m_Helped;			// run by threads outside the pool in RunPendingTask
+
+	// merged over the workers
+	TaskHistogram	m_WaitTime;
+	TaskHistogram	m_RunTime;
+
+	std::vector<TaskWorkerStats> m_Workers;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	TaskStatsRecorder holds the live counters of one worker. Only the worker writes them,
+	so a plain load and store replaces the read-modify-write; Stats reads them from any thread.
+*/
+class TaskStatsRecorder
+{
+public:
+	TaskStatsRecorder() : m_Executed(0), m_Stolen(0), m_Parked(0)
+	{
+#if defined(AMTL_TASKPROCESSOR_STATS)
+		for (Counter& bucket : m_WaitBuckets)
+			bucket.store(0, std::memory_order_relaxed);
+		for (Counter& bucket : m_RunBuckets)
+			bucket.store(0, std::memory_order_relaxed);
+		for (Counter& total : m_Totals)
+			total.store(0, std::memory_order_relaxed);
+#endif
+	}
+
+	TaskStatsRecorder(const TaskStatsRecorder&) = delete;
+	TaskStatsRecorder& operator=(const TaskStatsRecorder&) = delete;
+
+	void Executed() { Bump(m_Executed, 1); }
+	void Stolen() { Bump(m_Stolen, 1); }
+	void Parked() { Bump(m_Parked, 1); }
+
+	// timestamps for the wait and run times; 0 and no-ops without AMTL_TASKPROCESSOR_STATS
+#if defined(AMTL_TASKPROCESSOR_STATS)
+	static std::uint64_t Clock()
+	{
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	void Ran(std::uint64_t queued, std::uint64_t started, std::uint64_t finished)
+	{
+		Record(m_WaitBuckets, WAIT, started - queued);
+		Record(m_RunBuckets, RUN, finished - started);
+	}
+#else
+	static std::uint64_t Clock() { return 0; }
+	void Ran(std::uint64_t, std::uint64_t, std::uint64_t) {}
+#endif
+
+	void Snapshot(TaskWorkerStats& stats) const
+	{
+		stats.m_Executed = m_Executed.load(std::memory_order_relaxed);
+		stats.m_Stolen = m_Stolen.load(std::memory_order_relaxed);
+		stats.m_Parked = m_Parked.load(std::memory_order_relaxed);
+#if defined(AMTL_TASKPROCESSOR_STATS)
+		Copy(m_WaitBuckets, WAIT, stats.m_WaitTime);
+		Copy(m_RunBuckets, RUN, stats.m_RunTime);
+#endif
+	}
+
+private:
+	typedef std::atomic<std::uint64_t> Counter;
+
+	static void Bump(Counter& counter, std::uint64_t value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	Counter		m_Executed;
+	Counter		m_Stolen;
+	Counter		m_Parked;
+
+#if defined(AMTL_TASKPROCESSOR_STATS)
+	// m_Totals holds count, total and max per histogram
+	enum { WAIT = 0, RUN = 3 };
+
+	void Record(Counter* buckets, unsigned totals, std::uint64_t value)
+	{
+		Bump(buckets[TaskHistogram::BucketOf(value)], 1);
+		Bump(m_Totals[totals], 1);
+		Bump(m_Totals[totals + 1], value);
+		if (value > m_Totals[totals + 2].load(std::memory_order_relaxed))
+			m_Totals[totals + 2].store(value, std::memory_order_relaxed);
+	}
+
+	void Copy(const Counter* buckets, unsigned totals, TaskHistogram& histogram) const
+	{
+		for (unsigned i = 0; i < TaskHistogram::BUCKET_COUNT; ++i)
+			histogram.m_Buckets[i] = buckets[i].load(std::memory_order_relaxed);
+		histogram.m_Count = m_Totals[totals].load(std::memory_order_relaxed);
+		histogram.m_Total = m_Totals[totals + 1].load(std::memory_order_relaxed);
+		histogram.m_Max = m_Totals[totals + 2].load(std::memory_order_relaxed);
+	}
+
+	Counter		m_Totals[6];
+	Counter		m_WaitBuckets[TaskHistogram::BUCKET_COUNT];
+	Counter		m_RunBuckets[TaskHistogram::BUCKET_COUNT];
+#endif
+};
+//-------------------------------------------------------------------------------------------------
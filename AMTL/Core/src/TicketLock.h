@@ -0,0 +1,84 @@
+//
+// Synchronization Primitives
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <cstdint>
+
+#include "CpuRelax.h"
+//-------------------------------------------------------------------------------------------------
+/*
+	TicketLock is a fair spinlock: lock() draws a ticket and waits until it is served, so
+	threads acquire the lock strictly in arrival order.
+
+	All waiters still watch the same counter, so every unlock invalidates one cache line in
+	every waiting core. To keep that traffic down a waiter pauses in proportion to its
+	distance from the head of the line before it looks again, and yields once it has paused
+	for a while. Use MCSLock or CLHLock when many threads contend at once.
+*/
+class TicketLock
+{
+public:
+	// pause iterations per thread ahead of us in the line
+	constexpr static unsigned BACKOFF_PER_WAITER = 8;
+
+	TicketLock() : m_NextTicket(0), m_NowServing(0) {}
+
+	TicketLock(const TicketLock&) = delete;
+	TicketLock& operator=(const TicketLock&) = delete;
+
+	void lock()
+	{
+		const std::uint32_t ticket = m_NextTicket.fetch_add(1, std::memory_order_relaxed);
+		SpinWait wait;
+		for (;;)
+		{
+			const std::uint32_t serving = m_NowServing.load(std::memory_order_acquire);
+			if (serving == ticket)
+				return;
+
+			wait.Once((ticket - serving) * BACKOFF_PER_WAITER);
+		}
+	}
+
+	void unlock()
+	{
+		// only the holder writes m_NowServing
+		m_NowServing.store(m_NowServing.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool tryLock()
+	{
+		std::uint32_t ticket = m_NowServing.load(std::memory_order_relaxed);
+		return m_NextTicket.compare_exchange_strong(ticket, ticket + 1, std::memory_order_acquire, std::memory_order_relaxed);
+	}
+
+private:
+	constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+	alignas(CACHE_LINE_SIZE) std::atomic<std::uint32_t>	m_NextTicket;
+	alignas(CACHE_LINE_SIZE) std::atomic<std::uint32_t>	m_NowServing;
+};
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,341 @@
+#include "TimerWheel.h"
+//-------------------------------------------------------------------------------------------------
+namespace
+{
+	unsigned CountTrailingZeros(std::uint64_t bits)
+	{
+#if defined(__GNUC__)
+		return static_cast<unsigned>(__builtin_ctzll(bits));
+#else
+		unsigned count = 0;
+		for (; (bits & 1) == 0; bits >>= 1)
+			++count;
+		return count;
+#endif
+	}
+
+	std::uint64_t RotateRight(std::uint64_t bits, unsigned shift)
+	{
+		shift &= 63;
+		return shift ? (bits >> shift) | (bits << (64 - shift)) : bits;
+	}
+}
+//-------------------------------------------------------------------------------------------------
+TimerEntry::TimerEntry(TaskFunction&& func, std::uint64_t period):
+	m_Deadline(0),
+	m_Period(period),
+	m_Level(0),
+	m_Slot(0),
+	m_Refs(1),
+	m_State(PENDING),
+	m_Running(false),
+	m_Func(std::move(func))
+{
+}
+//-------------------------------------------------------------------------------------------------
+void TimerEntry::Run()
+{
+	if (m_Period == 0)
+	{
+		int expected = PENDING;
+		if (m_State.compare_exchange_strong(expected, STARTED, std::memory_order_acq_rel))
+			m_Func();
+	}
+	else
+	{
+		if (m_State.load(std::memory_order_acquire) != CANCELED)
+			m_Func();
+		m_Running.store(false, std::memory_order_release);
+	}
+	Release();
+}
+//-------------------------------------------------------------------------------------------------
+void TimerEntry::Skip()
+{
+	if (m_Period != 0)
+		m_Running.store(false, std::memory_order_release);
+	Release();
+}
+//-------------------------------------------------------------------------------------------------
+bool TimerHandle::Cancel()
+{
+	return m_Entry ? m_Wheel->Cancel(m_Entry) : false;
+}
+//-------------------------------------------------------------------------------------------------
+TimerWheel::TimerWheel(Dispatch dispatch, void* context):
+	m_Dispatch(dispatch),
+	m_Context(context),
+	m_Epoch(Clock::now()),
+	m_Started(false),
+	m_Stopping(false),
+	m_Current(0),
+	m_SleepUntil(NEVER)
+{
+	for (unsigned level = 0; level < LEVELS; ++level)
+	{
+		m_Occupied[level] = 0;
+		for (TimerLink& slot : m_Slots[level])
+			slot.m_Prev = slot.m_Next = &slot;
+	}
+}
+//-------------------------------------------------------------------------------------------------
+TimerWheel::~TimerWheel()
+{
+	Stop();
+}
+//-------------------------------------------------------------------------------------------------
+void TimerWheel::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Lock);
+		m_Stopping = true;
+	}
+	m_Wake.notify_one();
+
+	if (m_Thread.joinable())
+		m_Thread.join();
+
+	std::lock_guard<std::mutex> lock(m_Lock);
+	for (unsigned level = 0; level < LEVELS; ++level)
+	{
+		for (TimerLink& slot : m_Slots[level])
+		{
+			while (slot.m_Next != &slot)
+			{
+				TimerEntry* entry = static_cast<TimerEntry*>(slot.m_Next);
+				Unlink(entry);
+				entry->m_State.store(TimerEntry::CANCELED, std::memory_order_relaxed);
+				entry->Release();
+			}
+		}
+	}
+}
+//-------------------------------------------------------------------------------------------------
+TimerHandle TimerWheel::Schedule(Clock::time_point when, Clock::duration period, TaskFunction&& func)
+{
+	std::uint64_t period_ticks = 0;
+	if (period > Clock::duration::zero())
+	{
+		const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(period);
+		period_ticks = static_cast<std::uint64_t>(ms.count()) + (ms < period ? 1 : 0);
+	}
+
+	TimerEntry* entry = new TimerEntry(std::move(func), period_ticks);
+	entry->m_Deadline = ToTicks(when);
+	entry->AddRef();	// the handle's
+
+	{
+		std::lock_guard<std::mutex> lock(m_Lock);
+		if (m_Stopping)
+		{
+			entry->m_State.store(TimerEntry::CANCELED, std::memory_order_relaxed);
+			entry->Release();
+			return TimerHandle(this, entry);
+		}
+
+		if (!m_Started)
+		{
+			m_Thread = std::thread([this] { ThreadLoop(); });
+			m_Started = true;
+		}
+
+		Place(entry);
+		if (entry->m_Deadline >= m_SleepUntil)
+			return TimerHandle(this, entry);
+	}
+
+	// due before the thread means to wake up
+	m_Wake.notify_one();
+	return TimerHandle(this, entry);
+}
+//-------------------------------------------------------------------------------------------------
+bool TimerWheel::Cancel(TimerEntry* entry)
+{
+	int expected = TimerEntry::PENDING;
+	if (!entry->m_State.compare_exchange_strong(expected, TimerEntry::CANCELED, std::memory_order_acq_rel))
+		return false;
+
+	std::lock_guard<std::mutex> lock(m_Lock);
+	if (entry->m_Next)
+	{
+		Unlink(entry);
+		entry->Release();
+	}
+	return true;
+}
+//-------------------------------------------------------------------------------------------------
+std::uint64_t TimerWheel::ToTicks(Clock::time_point when) const
+{
+	if (when <= m_Epoch)
+		return 0;
+
+	// round up: a timer never fires early
+	const Clock::duration since = when - m_Epoch;
+	const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(since);
+	return static_cast<std::uint64_t>(ms.count()) + (ms < since ? 1 : 0);
+}
+//-------------------------------------------------------------------------------------------------
+std::uint64_t TimerWheel::ElapsedTicks() const
+{
+	// round down: only ticks that have fully passed are processed
+	return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - m_Epoch).count());
+}
+//-------------------------------------------------------------------------------------------------
+std::uint64_t TimerWheel::NextEvent() const
+{
+	// slot s of a level comes due at the first tick after m_Current whose index at that level
+	// is s and that starts a whole slot there; an occupied slot is never the current one
+	std::uint64_t next = NEVER;
+	for (unsigned level = 0; level < LEVELS; ++level)
+	{
+		if (!m_Occupied[level])
+			continue;
+
+		const unsigned shift = level * SLOT_BITS;
+		const std::uint64_t block = m_Current >> shift;
+		const unsigned index = static_cast<unsigned>(block & (SLOTS - 1));
+
+		const std::uint64_t ahead = RotateRight(m_Occupied[level], index + 1);
+		const std::uint64_t due = (block + CountTrailingZeros(ahead) + 1) << shift;
+		if (due < next)
+			next = due;
+	}
+	return next;
+}
+//-------------------------------------------------------------------------------------------------
+void TimerWheel::Advance(std::uint64_t now)
+{
+	for (std::uint64_t tick = NextEvent(); tick <= now; tick = NextEvent())
+	{
+		m_Current = tick;
+
+		// cascade coarse slots first, their entries may be due on this very tick
+		for (unsigned level = LEVELS - 1; level > 0; --level)
+		{
+			const unsigned shift = level * SLOT_BITS;
+			if ((tick & ((std::uint64_t(1) << shift) - 1)) == 0)
+				Expire(m_Slots[level][(tick >> shift) & (SLOTS - 1)], level);
+		}
+		Expire(m_Slots[0][tick & (SLOTS - 1)], 0);
+	}
+
+	// nothing was due in between, so jumping ahead keeps every entry in its slot
+	if (now > m_Current)
+		m_Current = now;
+}
+//-------------------------------------------------------------------------------------------------
+void TimerWheel::Expire(TimerLink& slot, unsigned level)
+{
+	// detach the whole list first: periodic entries may be placed back into this slot
+	TimerLink list;
+	if (slot.m_Next == &slot)
+		return;
+
+	list.m_Next = slot.m_Next;
+	list.m_Prev = slot.m_Prev;
+	list.m_Next->m_Prev = &list;
+	list.m_Prev->m_Next = &list;
+	slot.m_Prev = slot.m_Next = &slot;
+	m_Occupied[level] &= ~(std::uint64_t(1) << (&slot - m_Slots[level]));
+
+	while (list.m_Next != &list)
+	{
+		TimerEntry* entry = static_cast<TimerEntry*>(list.m_Next);
+		list.m_Next = entry->m_Next;
+		list.m_Next->m_Prev = &list;
+		entry->m_Prev = entry->m_Next = nullptr;
+
+		Place(entry);
+	}
+}
+//-------------------------------------------------------------------------------------------------
+void TimerWheel::Place(TimerEntry* entry)
+{
+	const std::uint64_t deadline = entry->m_Deadline;
+	if (deadline <= m_Current)
+	{
+		Fire(entry);
+		return;
+	}
+
+	// the lowest level whose slots still reach the deadline
+	for (unsigned level = 0; level < LEVELS; ++level)
+	{
+		const unsigned shift = level * SLOT_BITS;
+		if ((deadline >> shift) - (m_Current >> shift) < SLOTS)
+		{
+			Link(entry, level, static_cast<unsigned>((deadline >> shift) & (SLOTS - 1)));
+			return;
+		}
+	}
+
+	// beyond the top level: wait in its farthest slot and be placed again from there
+	const unsigned shift = (LEVELS - 1) * SLOT_BITS;
+	Link(entry, LEVELS - 1, static_cast<unsigned>(((m_Current >> shift) + SLOTS - 1) & (SLOTS - 1)));
+}
+//-------------------------------------------------------------------------------------------------
+void TimerWheel::Fire(TimerEntry* entry)
+{
+	if (entry->m_State.load(std::memory_order_acquire) == TimerEntry::CANCELED)
+	{
+		entry->Release();
+		return;
+	}
+
+	if (entry->m_Period == 0)
+	{
+		// the wheel's reference goes to the run
+		m_Dispatch(m_Context, entry);
+		return;
+	}
+
+	if (!entry->m_Running.exchange(true, std::memory_order_acq_rel))
+	{
+		entry->AddRef();
+		m_Dispatch(m_Context, entry);
+	}
+
+	// fixed rate: the next multiple of the period after now
+	const std::uint64_t missed = (m_Current - entry->m_Deadline) / entry->m_Period + 1;
+	entry->m_Deadline += missed * entry->m_Period;
+	Place(entry);
+}
+//-------------------------------------------------------------------------------------------------
+void TimerWheel::Link(TimerEntry* entry, unsigned level, unsigned slot)
+{
+	TimerLink& head = m_Slots[level][slot];
+	entry->m_Level = static_cast<unsigned char>(level);
+	entry->m_Slot = static_cast<unsigned char>(slot);
+	entry->m_Prev = head.m_Prev;
+	entry->m_Next = &head;
+	head.m_Prev->m_Next = entry;
+	head.m_Prev = entry;
+	m_Occupied[level] |= std::uint64_t(1) << slot;
+}
+//-------------------------------------------------------------------------------------------------
+void TimerWheel::Unlink(TimerEntry* entry)
+{
+	entry->m_Prev->m_Next = entry->m_Next;
+	entry->m_Next->m_Prev = entry->m_Prev;
+	entry->m_Prev = entry->m_Next = nullptr;
+
+	TimerLink& head = m_Slots[entry->m_Level][entry->m_Slot];
+	if (head.m_Next == &head)
+		m_Occupied[entry->m_Level] &= ~(std::uint64_t(1) << entry->m_Slot);
+}
+//-------------------------------------------------------------------------------------------------
+void TimerWheel::ThreadLoop()
+{
+	std::unique_lock<std::mutex> lock(m_Lock);
+	while (!m_Stopping)
+	{
+		Advance(ElapsedTicks());
+
+		m_SleepUntil = NextEvent();
+		if (m_SleepUntil == NEVER)
+			m_Wake.wait(lock);
+		else
+			m_Wake.wait_until(lock, m_Epoch + std::chrono::milliseconds(m_SleepUntil));
+	}
+}
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,207 @@
+//
+// Timer wheel
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "Task.h"
+//-------------------------------------------------------------------------------------------------
+// intrusive links of a timer; the slots of the wheel are bare sentinels
+struct TimerLink
+{
+	TimerLink*	m_Prev = nullptr;
+	TimerLink*	m_Next = nullptr;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	TimerEntry is one scheduled function. It is reference counted: the wheel holds a reference
+	while the entry is linked, the TimerHandle holds one, and so does every run posted to the pool.
+*/
+class TimerEntry : private TimerLink
+{
+public:
+	TimerEntry(TaskFunction&& func, std::uint64_t period);
+
+	void AddRef() { m_Refs.fetch_add(1, std::memory_order_relaxed); }
+
+	void Release()
+	{
+		if (m_Refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+
+	// invokes the function unless the timer was canceled, then drops the run's reference
+	void Run();
+
+	// gives up a run that could not be queued or was dropped from the queue: drops its reference
+	// without invoking the function, a periodic timer fires again on its next period
+	void Skip();
+
+private:
+	friend class TimerWheel;
+
+	enum
+	{
+		PENDING,
+		STARTED,	// a one-shot timer began to run
+		CANCELED
+	};
+
+	std::uint64_t			m_Deadline;		// in wheel ticks
+	const std::uint64_t		m_Period;		// in wheel ticks, 0 for one-shot timers
+	unsigned char			m_Level;		// where the entry is linked
+	unsigned char			m_Slot;
+	std::atomic<int>		m_Refs;
+	std::atomic<int>		m_State;
+	std::atomic<bool>		m_Running;		// a periodic run is queued or executing
+	TaskFunction			m_Func;
+};
+//-------------------------------------------------------------------------------------------------
+class TimerWheel;
+
+/*
+	TimerHandle refers to a scheduled timer. Dropping the handle leaves the timer running;
+	Cancel stops it in O(1). A handle must not be used after its TaskProcessor is gone.
+*/
+class TimerHandle
+{
+public:
+	TimerHandle() : m_Wheel(nullptr), m_Entry(nullptr) {}
+
+	// adopts a reference to entry
+	TimerHandle(TimerWheel* wheel, TimerEntry* entry) : m_Wheel(wheel), m_Entry(entry) {}
+
+	TimerHandle(TimerHandle&& other) noexcept:
+		m_Wheel(other.m_Wheel),
+		m_Entry(other.m_Entry)
+	{
+		other.m_Entry = nullptr;
+	}
+
+	TimerHandle& operator=(TimerHandle&& other) noexcept
+	{
+		if (this != &other)
+		{
+			if (m_Entry)
+				m_Entry->Release();
+			m_Wheel = other.m_Wheel;
+			m_Entry = other.m_Entry;
+			other.m_Entry = nullptr;
+		}
+		return *this;
+	}
+
+	TimerHandle(const TimerHandle&) = delete;
+	TimerHandle& operator=(const TimerHandle&) = delete;
+
+	~TimerHandle()
+	{
+		if (m_Entry)
+			m_Entry->Release();
+	}
+
+	bool Valid() const { return m_Entry != nullptr; }
+
+	// true if this stopped the timer: a one-shot timer that had not started, or any periodic
+	// one. A run that is already executing finishes.
+	bool Cancel();
+
+private:
+	TimerWheel*	m_Wheel;
+	TimerEntry*	m_Entry;
+};
+//-------------------------------------------------------------------------------------------------
+/*
+	TimerWheel is a hierarchical timing wheel with 1 ms ticks: LEVELS levels of SLOTS slots,
+	each level SLOTS times coarser than the one below, which covers 64^6 ms (about two years;
+	later deadlines wait in the top level and are re-placed when it comes round). Entries sit in
+	intrusive lists, so scheduling and canceling are O(1); an entry moves down a level whenever
+	the slot it sits in comes due.
+
+	A single thread, started with the first timer, services the wheel. Occupancy bitmaps let it
+	compute the next tick that has anything to do and sleep until then instead of ticking. Due
+	entries are handed to the dispatch callback, which queues them on the pool; periodic timers
+	keep a fixed rate and skip a period while their previous run is still queued or running.
+*/
+class TimerWheel
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	// dispatch must queue entry->Run() somewhere; it is called with the wheel locked
+	typedef void (*Dispatch)(void* context, TimerEntry* entry);
+
+	TimerWheel(Dispatch dispatch, void* context);
+	~TimerWheel();
+
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	// period zero schedules a one-shot timer
+	TimerHandle Schedule(Clock::time_point when, Clock::duration period, TaskFunction&& func);
+
+	bool Cancel(TimerEntry* entry);
+
+	// stops the timer thread and drops every timer that has not fired yet
+	void Stop();
+
+private:
+	constexpr static unsigned LEVELS = 6;
+	constexpr static unsigned SLOT_BITS = 6;
+	constexpr static unsigned SLOTS = 1u << SLOT_BITS;
+	constexpr static std::uint64_t NEVER = ~std::uint64_t(0);
+
+	std::uint64_t ToTicks(Clock::time_point when) const;
+	std::uint64_t ElapsedTicks() const;
+	std::uint64_t NextEvent() const;
+	void Advance(std::uint64_t now);
+	void Expire(TimerLink& slot, unsigned level);
+	void Place(TimerEntry* entry);
+	void Fire(TimerEntry* entry);
+	void Link(TimerEntry* entry, unsigned level, unsigned slot);
+	void Unlink(TimerEntry* entry);
+	void ThreadLoop();
+
+	const Dispatch			m_Dispatch;
+	void* const				m_Context;
+	const Clock::time_point	m_Epoch;
+
+	std::mutex				m_Lock;
+	std::condition_variable	m_Wake;
+	std::thread				m_Thread;
+	bool					m_Started;
+	bool					m_Stopping;
+	std::uint64_t			m_Current;		// last tick processed
+	std::uint64_t			m_SleepUntil;	// tick the thread sleeps until, NEVER if idle
+
+	std::uint64_t			m_Occupied[LEVELS];
+	TimerLink				m_Slots[LEVELS][SLOTS];
+};
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+
+#include "EventCount.h"
+#include "CpuRelax.h"
+
+namespace amtl
+{
+    namespace detail
+    {
+
+        /*
+            waitable_queue supplies the blocking half of the queue interface shared by MPMCQueue and its
+            single-producer/single-consumer variants. Derived only has to provide the non-blocking
+            try_pop(T&) and pop(), and to call not_empty.NotifyOne()/NotifyAll() after it published items.
+
+            A consumer first spins on the non-blocking pop for a little while, then parks on not_empty.
+            A producer that finds nobody parked pays a single load of the waiter count.
+        */
+        template<class Derived, class T>
+        class waitable_queue
+        {
+            protected:
+
+                EventCount not_empty;
+
+                // how many times wait_pop() retries before it parks
+                constexpr static int WAIT_SPIN_COUNT = 64;
+
+                waitable_queue() = default;
+                ~waitable_queue() = default;
+
+            private:
+
+                Derived& derived() noexcept { return static_cast<Derived&>(*this); }
+
+                // wait_impl spins on try_pop_once for a little while, then parks on not_empty until a push() wakes
+                // it. A null deadline waits forever. Returns false if the deadline passed first.
+                template<class TryPop>
+                bool wait_impl(TryPop&& try_pop_once, const std::chrono::steady_clock::time_point* deadline)
+                {
+                    for(int spin = 0; spin != WAIT_SPIN_COUNT; ++spin)
+                    {
+                        if(try_pop_once())
+                        {
+                            return true;
+                        }
+                        CpuRelax();
+                    }
+
+                    for(;;)
+                    {
+                        const EventCount::Key key = not_empty.PrepareWait();
+                        if(try_pop_once())
+                        {
+                            not_empty.CancelWait();
+                            return true;
+                        }
+
+                        if(! deadline)
+                        {
+                            not_empty.Wait(key);
+                        }
+                        else if(! not_empty.WaitFor(key,*deadline - std::chrono::steady_clock::now()))
+                        {
+                            return try_pop_once();
+                        }
+
+                        if(try_pop_once())
+                        {
+                            return true;
+                        }
+                    }
+                }
+
+            public:
+
+                waitable_queue(const waitable_queue&) = delete;
+                waitable_queue& operator=(const waitable_queue&) = delete;
+
+                // wait_pop removes the next item like try_pop, but if the queue is empty it blocks until one arrives.
+                // It spins briefly first and then parks the thread, so an idle consumer costs no CPU.
+                void wait_pop(T& out)
+                {
+                    wait_impl([&]{ return derived().try_pop(out); },nullptr);
+                }
+
+                std::unique_ptr<T> wait_pop()
+                {
+                    std::unique_ptr<T> data;
+                    wait_impl([&]{ data = derived().pop(); return data != nullptr; },nullptr);
+                    return data;
+                }
+
+                // wait_pop_for is wait_pop with a timeout; it returns false (or an empty unique_ptr) if the
+                // queue stayed empty for the whole timeout.
+                template<class Rep, class Period>
+                bool wait_pop_for(T& out, const std::chrono::duration<Rep,Period>& timeout)
+                {
+                    const auto deadline = std::chrono::steady_clock::now() + timeout;
+                    return wait_impl([&]{ return derived().try_pop(out); },&deadline);
+                }
+
+                template<class Rep, class Period>
+                std::unique_ptr<T> wait_pop_for(const std::chrono::duration<Rep,Period>& timeout)
+                {
+                    const auto deadline = std::chrono::steady_clock::now() + timeout;
+                    std::unique_ptr<T> data;
+                    wait_impl([&]{ data = derived().pop(); return data != nullptr; },&deadline);
+                    return data;
+                }
+        };
+    }
+}
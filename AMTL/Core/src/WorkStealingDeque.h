@@ -0,0 +1,164 @@
+//
+// Work-stealing deque
+//
+// Copyright (c) 2015  Dmitry Popov
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+#pragma once
+//-------------------------------------------------------------------------------------------------
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include <memory>
+//-------------------------------------------------------------------------------------------------
+/*
+	WorkStealingDeque is the Chase-Lev deque, with the memory orderings from
+	"Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al., 2013).
+
+	Exactly one thread (the owner) may call Push and Pop; they work on the bottom end
+	and do not need a CAS unless the deque is down to its last element. Any number of
+	other threads may call Steal, which takes from the top end with a single CAS.
+
+	T must be trivially copyable (the deque is meant to hold pointers).
+	The ring grows on demand; retired rings are kept until the deque is destroyed,
+	because a concurrent thief may still be reading from them.
+*/
+template<class T>
+class WorkStealingDeque
+{
+public:
+	explicit WorkStealingDeque(std::size_t capacity = 256):
+		m_Top(0),
+		m_Bottom(0)
+	{
+		std::size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+
+		m_Rings.emplace_back(new Ring(size));
+		m_Ring.store(m_Rings.back().get(), std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(const WorkStealingDeque&) = delete;
+	WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+	// Owner only.
+	void Push(T item)
+	{
+		std::int64_t b = m_Bottom.load(std::memory_order_relaxed);
+		std::int64_t t = m_Top.load(std::memory_order_acquire);
+		Ring* ring = m_Ring.load(std::memory_order_relaxed);
+
+		if (b - t > static_cast<std::int64_t>(ring->m_Mask))
+			ring = Grow(ring, t, b);
+
+		ring->Put(b, item);
+		std::atomic_thread_fence(std::memory_order_release);
+		m_Bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	// Owner only. Takes the most recently pushed item.
+	bool Pop(T& item)
+	{
+		std::int64_t b = m_Bottom.load(std::memory_order_relaxed) - 1;
+		Ring* ring = m_Ring.load(std::memory_order_relaxed);
+		m_Bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t t = m_Top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			// empty
+			m_Bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+
+		item = ring->Get(b);
+		if (t != b)
+			return true;
+
+		// last element, race against thieves for it
+		bool won = m_Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		m_Bottom.store(b + 1, std::memory_order_relaxed);
+		return won;
+	}
+
+	// Any thread. Takes the oldest item; fails if the deque is empty or another thread won the race.
+	bool Steal(T& item)
+	{
+		std::int64_t t = m_Top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::int64_t b = m_Bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+			return false;
+
+		Ring* ring = m_Ring.load(std::memory_order_acquire);
+		item = ring->Get(t);
+		return m_Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+	}
+
+	// Approximate, may be stale by the time it returns.
+	std::size_t Size() const
+	{
+		std::int64_t b = m_Bottom.load(std::memory_order_relaxed);
+		std::int64_t t = m_Top.load(std::memory_order_relaxed);
+		return (b > t) ? static_cast<std::size_t>(b - t) : 0;
+	}
+
+	bool Empty() const { return Size() == 0; }
+
+private:
+	constexpr static std::size_t CACHE_LINE_SIZE = 64;
+
+	struct Ring
+	{
+		explicit Ring(std::size_t size):
+			m_Mask(size - 1),
+			m_Items(new std::atomic<T>[size])
+		{
+		}
+
+		T Get(std::int64_t i) const { return m_Items[i & m_Mask].load(std::memory_order_relaxed); }
+		void Put(std::int64_t i, T item) { m_Items[i & m_Mask].store(item, std::memory_order_relaxed); }
+
+		std::size_t m_Mask;
+		std::unique_ptr<std::atomic<T>[]> m_Items;
+	};
+
+	Ring* Grow(Ring* ring, std::int64_t t, std::int64_t b)
+	{
+		std::unique_ptr<Ring> bigger(new Ring((ring->m_Mask + 1) * 2));
+		for (std::int64_t i = t; i < b; ++i)
+			bigger->Put(i, ring->Get(i));
+
+		Ring* result = bigger.get();
+		m_Rings.push_back(std::move(bigger));
+		m_Ring.store(result, std::memory_order_release);
+		return result;
+	}
+
+	alignas(CACHE_LINE_SIZE) std::atomic<std::int64_t>	m_Top;
+	alignas(CACHE_LINE_SIZE) std::atomic<std::int64_t>	m_Bottom;
+	alignas(CACHE_LINE_SIZE) std::atomic<Ring*>			m_Ring;
+	std::vector<std::unique_ptr<Ring>>					m_Rings;	// owner only
+};
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,133 @@
+#include "Future.h"
+#include "ParallelFor.h"
+#include "Strand.h"
+#include "TaskGroup.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <thread>
+//-------------------------------------------------------------------------------------------------
+/*
+	Shuts a pool down with DrainPolicy::Drop while its only worker is busy, so everything queued
+	behind it is dropped, and checks that every kind of waiter is released instead of hanging:
+	futures fail, the group reports a cancel, the strand lets go and the loop throws.
+*/
+int main()
+{
+	TaskProcessorOptions options;
+	options.m_ThreadCount = 1;
+	TaskProcessor processor(options);
+
+	int failures = 0;
+	std::atomic<bool> busy(false);
+	std::atomic<bool> release(false);
+	std::atomic<int> ran(0);
+
+	// keeps the worker busy until Shutdown has started
+	processor.Post([&busy, &release]
+	{
+		busy.store(true);
+		while (!release.load())
+			std::this_thread::yield();
+	});
+	while (!busy.load())
+		std::this_thread::yield();
+
+	Future<int> async = Async(processor, [&ran] { ++ran; return 1; });
+	std::future<int> added = processor.Add([&ran] { ++ran; return 2; });
+
+	TaskGroup group(processor);
+	for (int i = 0; i != 4; ++i)
+		group.Run([&ran] { ++ran; });
+
+	Strand* strand = new Strand(processor);
+	for (int i = 0; i != 4; ++i)
+		strand->Post([&ran] { ++ran; });
+	std::future<void> stranded = strand->Add([&ran] { ++ran; });
+
+	TimerHandle timer = processor.AddAfter(std::chrono::milliseconds(1), [&ran] { ++ran; });
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));	// the timer's run is queued by now
+
+	// the loop's caller runs its first chunk itself and holds it until the rest was dropped
+	std::atomic<bool> dropped(false);
+	std::atomic<bool> looping(false);
+	bool loopDropped = false;
+	std::thread loop([&]
+	{
+		try
+		{
+			ParallelFor(processor, 0, 8, 1, [&](int begin, int)
+			{
+				if (begin == 0)
+				{
+					looping.store(true);
+					while (!dropped.load())
+						std::this_thread::yield();
+				}
+				else
+				{
+					++ran;
+				}
+			});
+		}
+		catch (const TaskDropped&)
+		{
+			loopDropped = true;
+		}
+	});
+	while (!looping.load())
+		std::this_thread::yield();
+
+	std::thread releaser([&release]
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		release.store(true);
+	});
+	const std::size_t count = processor.Shutdown(DrainPolicy::Drop());
+	dropped.store(true);
+	releaser.join();
+	loop.join();
+
+	try
+	{
+		async.Get();
+		++failures;
+	}
+	catch (const TaskDropped&)
+	{
+	}
+
+	try
+	{
+		added.get();
+		++failures;
+	}
+	catch (const std::future_error& error)
+	{
+		if (error.code() != std::future_errc::broken_promise)
+			++failures;
+	}
+
+	if (group.Wait())
+		++failures;
+
+	delete strand;	// waits for its tasks, which are gone with the drain
+	try
+	{
+		stranded.get();
+		++failures;
+	}
+	catch (const std::future_error&)
+	{
+	}
+
+	if (!loopDropped)
+		++failures;
+	if (ran.load() != 0)
+		++failures;
+
+	std::printf("dropped %u tasks, %d failures\n", static_cast<unsigned>(count), failures);
+	return failures == 0 ? 0 : 1;
+}
+//-------------------------------------------------------------------------------------------------
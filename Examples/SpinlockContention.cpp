@@ -0,0 +1,48 @@
+#include "SpinLock.h"
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+//-------------------------------------------------------------------------------------------------
+/*
+	Hammers a futex-backed spinlock: each round the main thread holds the lock long enough for
+	the workers to run out of backoff and park, then lets them fight over it. A lost wake-up
+	shows up as a hang (ctest times it out), a broken mutual exclusion as a wrong total.
+*/
+int main()
+{
+	const int THREADS = 4;
+	const int ROUNDS = 20;
+	const int ITERATIONS = 2000;
+
+	BasicSpinlock<FutexBackoff> lock;
+	long counter = 0;
+
+	for (int round = 0; round != ROUNDS; ++round)
+	{
+		std::vector<std::thread> threads;
+		lock.lock();
+		for (int i = 0; i != THREADS; ++i)
+		{
+			threads.emplace_back([&]()
+			{
+				for (int j = 0; j != ITERATIONS; ++j)
+				{
+					std::lock_guard<BasicSpinlock<FutexBackoff>> guard(lock);
+					++counter;
+				}
+			});
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		lock.unlock();
+
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	const long expected = long(THREADS) * ROUNDS * ITERATIONS;
+	std::printf("counter %ld, expected %ld\n", counter, expected);
+	return counter == expected ? 0 : 1;
+}
+//-------------------------------------------------------------------------------------------------
@@ -0,0 +1,65 @@
+#include "Future.h"
+#include <cstdio>
+#include <vector>
+//-------------------------------------------------------------------------------------------------
+/*
+	Races a few futures with WhenAny and chains Then on the winner and on every loser. The losers
+	come back without WhenAny's callback on them, so the continuations attach cleanly and run
+	once their promises are kept.
+*/
+int main()
+{
+	TaskProcessor processor;
+	int failures = 0;
+
+	// promises kept by hand: the winner is known, the losers are still pending
+	{
+		std::vector<Promise<int>> promises;
+		std::vector<Future<int>> futures;
+		for (int i = 0; i != 3; ++i)
+		{
+			promises.emplace_back(processor);
+			futures.push_back(promises.back().GetFuture());
+		}
+
+		Future<WhenAnyResult<int>> any = WhenAny(std::move(futures));
+		promises[1].SetValue(10);
+		WhenAnyResult<int> result = any.Get();
+		if (result.m_Index != 1)
+			++failures;
+
+		std::vector<Future<int>> chained;
+		for (Future<int>& future : result.m_Futures)
+			chained.push_back(future.Then([](int value) { return value + 1; }));
+
+		promises[0].SetValue(0);
+		promises[2].SetValue(20);
+
+		const int expected[] = { 1, 11, 21 };
+		for (std::size_t i = 0; i != chained.size(); ++i)
+		{
+			if (chained[i].Get() != expected[i])
+				++failures;
+		}
+	}
+
+	// tasks racing on the pool: losers may become ready while WhenAny hands them back
+	for (int round = 0; round != 1000; ++round)
+	{
+		std::vector<Future<int>> futures;
+		for (int i = 0; i != 4; ++i)
+			futures.push_back(Async(processor, [i]() { return i; }));
+
+		WhenAnyResult<int> result = WhenAny(std::move(futures)).Get();
+
+		int sum = 0;
+		for (Future<int>& future : result.m_Futures)
+			sum += future.Then([](int value) { return value * 2; }).Get();
+		if (sum != 12)
+			++failures;
+	}
+
+	std::printf("%d failures\n", failures);
+	return failures == 0 ? 0 : 1;
+}
+//-------------------------------------------------------------------------------------------------
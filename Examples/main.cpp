@@ -1,13 +1,14 @@
 #include "TaskProcessor.h"
 #include "MTQueue.h"
 #include <iostream>
+#include <cstdio>
 //-------------------------------------------------------------------------------------------------
 int main(int argc, char* argv[])
 {
 	TaskProcessor processor;
 	processor.Add([](){std::cout << "Hello world" << std::endl; });
 
-	MT::Structs::MTQueue<int> queue;
+	MTQueue<int> queue;
 
 	std::getchar();
 